@@ -0,0 +1,402 @@
+#include "generator.h"
+
+#include <builder.h>
+#include <server.h>
+#include <static_handler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    ProjectParams params;
+    std::filesystem::path dir;
+    std::string filter;
+    std::chrono::milliseconds min_time = std::chrono::milliseconds(500);
+    unsigned int min_iterations = 5;
+    bool csv = false;
+    bool keep = false;
+    bool generate_only = false;
+};
+
+///measured benchmark
+struct Result {
+    std::string name;
+    unsigned int iterations = 0;
+    double median_us = 0;
+    double min_us = 0;
+    ///bytes processed by single iteration (0 if not applicable)
+    std::uint64_t bytes = 0;
+    ///items processed by single iteration (0 if not applicable)
+    std::uint64_t items = 0;
+};
+
+class Runner {
+public:
+    explicit Runner(const Options &opts):_opts(opts) {}
+
+    ///Run benchmark
+    /**
+     * @param name name of the benchmark
+     * @param bytes bytes processed by one iteration
+     * @param items items processed by one iteration
+     * @param fn measured function
+     * @param setup function called before every iteration, not measured
+     */
+    void run(std::string_view name, std::uint64_t bytes, std::uint64_t items,
+            const std::function<void()> &fn, const std::function<void()> &setup = nullptr) {
+        if (!selected(name)) return;
+        //warm up
+        if (setup) setup();
+        fn();
+        std::vector<double> samples;
+        Clock::duration total = {};
+        while (samples.size() < _opts.min_iterations || (total < _opts.min_time && samples.size() < 10000)) {
+            if (setup) setup();
+            auto start = Clock::now();
+            fn();
+            auto d = Clock::now() - start;
+            total += d;
+            samples.push_back(std::chrono::duration<double, std::micro>(d).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        Result r;
+        r.name = name;
+        r.iterations = static_cast<unsigned int>(samples.size());
+        r.median_us = samples[samples.size()/2];
+        r.min_us = samples.front();
+        r.bytes = bytes;
+        r.items = items;
+        print(r);
+    }
+
+    ///Benchmark is selected by the filter
+    bool selected(std::string_view name) const {
+        return _opts.filter.empty() || name.find(_opts.filter) != name.npos;
+    }
+
+    void print_header() const {
+        const auto &p = _opts.params;
+        std::ostringstream cfg;
+        cfg << "scripts=" << p.scripts << " depth=" << p.depth << " fanout=" << p.fanout
+            << " script_size=" << p.script_size << " styles=" << p.styles << " style_size=" << p.style_size
+            << " search_paths=" << p.search_paths << " resources=" << p.resources
+            << " resource_size=" << p.resource_size << " seed=" << p.seed;
+        if (_opts.csv) {
+            std::cout << "# " << cfg.str() << "\n"
+                      << "benchmark,iterations,median_us,min_us,mb_per_s,items_per_s\n";
+        } else {
+            std::cout << "# " << cfg.str() << "\n";
+            std::printf("%-40s %8s %14s %14s %12s %14s\n", "# benchmark", "iters", "median_us", "min_us", "MB/s", "items/s");
+        }
+        std::cout.flush();
+    }
+
+protected:
+    const Options &_opts;
+
+    void print(const Result &r) const {
+        double secs = r.median_us / 1e6;
+        double mbs = r.bytes && secs > 0?static_cast<double>(r.bytes) / secs / 1048576.0:0;
+        double ips = r.items && secs > 0?static_cast<double>(r.items) / secs:0;
+        if (_opts.csv) {
+            std::printf("%s,%u,%.3f,%.3f,%.2f,%.0f\n", r.name.c_str(), r.iterations, r.median_us, r.min_us, mbs, ips);
+        } else {
+            std::printf("%-40s %8u %14.3f %14.3f %12.2f %14.0f\n", r.name.c_str(), r.iterations, r.median_us, r.min_us, mbs, ips);
+        }
+        std::fflush(stdout);
+    }
+};
+
+static std::string read_all(const std::filesystem::path &p) {
+    std::ifstream f(p, std::ios::in|std::ios::binary);
+    std::ostringstream s;
+    s << f.rdbuf();
+    return std::move(s).str();
+}
+
+static void show_help() {
+    std::cout << "Usage: webproject_bench [options]\n\n"
+        "Generates synthetic project and measures the builder\n\n"
+        "-h                   Show help\n"
+        "-n <count>           Count of scripts (default 200)\n"
+        "-d <depth>           Maximum depth of requires (default 4)\n"
+        "-f <count>           Fan-out - count of requires in each script (default 4)\n"
+        "-b <bytes>           Size of script (default 4096)\n"
+        "-c <count>           Count of styles (default 50)\n"
+        "-B <bytes>           Size of style (default 2048)\n"
+        "-p <count>           Count of search paths for scripts (default 4)\n"
+        "-r <count>           Count of resources (default 100)\n"
+        "-R <bytes>           Size of resource (default 4096)\n"
+        "-s <seed>            Seed of the generator (default 1)\n"
+        "-t <ms>              Minimal measured time of each benchmark (default 500)\n"
+        "-i <count>           Minimal count of iterations (default 5)\n"
+        "-x <text>            Run only benchmarks containing the text\n"
+        "-o <dir>             Working directory, must be empty or not exist. It is kept\n"
+        "                     (default: temporary directory)\n"
+        "-g                   Only generate the project to the working directory\n"
+        "-k                   Keep the temporary working directory\n"
+        "-C                   Output in CSV format\n";
+}
+
+static bool parse_args(int argc, char **argv, Options &opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view a = argv[i];
+        if (a.size() != 2 || a[0] != '-') {
+            std::cerr << "Invalid argument: " << a << std::endl;
+            return false;
+        }
+        char c = a[1];
+        switch (c) {
+            case 'h': show_help(); std::exit(0);
+            case 'g': opts.generate_only = true; opts.keep = true; continue;
+            case 'k': opts.keep = true; continue;
+            case 'C': opts.csv = true; continue;
+            default: break;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Expects argument: " << a << std::endl;
+            return false;
+        }
+        std::string v = argv[++i];
+        auto num = [&]{return std::strtoull(v.c_str(), nullptr, 10);};
+        switch (c) {
+            case 'n': opts.params.scripts = static_cast<unsigned int>(num());break;
+            case 'd': opts.params.depth = static_cast<unsigned int>(num());break;
+            case 'f': opts.params.fanout = static_cast<unsigned int>(num());break;
+            case 'b': opts.params.script_size = num();break;
+            case 'c': opts.params.styles = static_cast<unsigned int>(num());break;
+            case 'B': opts.params.style_size = num();break;
+            case 'p': opts.params.search_paths = static_cast<unsigned int>(num());break;
+            case 'r': opts.params.resources = static_cast<unsigned int>(num());break;
+            case 'R': opts.params.resource_size = num();break;
+            case 's': opts.params.seed = static_cast<std::uint32_t>(num());break;
+            case 't': opts.min_time = std::chrono::milliseconds(num());break;
+            case 'i': opts.min_iterations = std::max<unsigned int>(1, static_cast<unsigned int>(num()));break;
+            case 'x': opts.filter = v;break;
+            case 'o': opts.dir = v;break;
+            default:
+                std::cerr << "Unknown switch: " << a << std::endl;
+                return false;
+        }
+    }
+    return true;
+}
+
+struct DirectiveRef {
+    SearchPaths::List SearchPaths::*section;
+    std::filesystem::path context;
+    std::string name;
+};
+
+///connect to the unix socket of the server, send the request and read at most limit bytes of the response
+static std::string http_request(const std::filesystem::path &sock, std::string_view request, std::size_t limit) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::system_error(errno, std::system_category(), "http_request: socket");
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, sock.c_str(), sizeof(addr.sun_path)-1);
+    std::string out;
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0
+            && ::send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size())) {
+        char buff[65536];
+        while (out.size() < limit) {
+            auto r = ::recv(fd, buff, std::min(sizeof(buff), limit - out.size()), 0);
+            if (r <= 0) break;
+            out.append(buff, r);
+        }
+    }
+    //closed with unread data - the server is in the middle of the transfer
+    ::close(fd);
+    return out;
+}
+
+static std::string mode_name(BuildMode m) {
+    switch (m) {
+        case BuildMode::symlink: return "symlink";
+        case BuildMode::hardlink: return "hardlink";
+        case BuildMode::copy: return "copy";
+        default:
+        case BuildMode::onefile: return "onefile";
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) return 1;
+    //only the temporary directory created by the benchmark is removed
+    if (opts.dir.empty()) {
+        opts.dir = std::filesystem::temp_directory_path() / ("webproject_bench." + std::to_string(::getpid()));
+    } else {
+        std::error_code ec;
+        if (std::filesystem::exists(opts.dir, ec) && !std::filesystem::is_empty(opts.dir, ec)) {
+            std::cerr << "Working directory is not empty: " << opts.dir.string() << std::endl;
+            return 1;
+        }
+        opts.keep = true;
+    }
+
+    try {
+        auto prj = generate_project(opts.dir / "src", opts.params);
+        if (opts.generate_only) {
+            std::cout << "Generated: " << prj.main.string() << std::endl;
+            return 0;
+        }
+
+        std::size_t warnings = 0;
+        auto wout = [&](std::string, int, std::string) {++warnings;};
+
+        //sources loaded to memory for micro benchmarks
+        std::vector<std::string> scripts;
+        std::vector<std::string> styles;
+        std::uint64_t script_bytes = 0;
+        std::uint64_t style_bytes = 0;
+        scripts.push_back(read_all(prj.main));
+        for (const auto &p: prj.scripts) scripts.push_back(read_all(p));
+        for (const auto &p: prj.styles) styles.push_back(read_all(p));
+        for (const auto &s: scripts) script_bytes += s.size();
+        for (const auto &s: styles) style_bytes += s.size();
+
+        std::vector<DirectiveRef> directives;
+        {
+            std::vector<std::filesystem::path> files = {prj.main};
+            files.insert(files.end(), prj.scripts.begin(), prj.scripts.end());
+            for (std::size_t i = 0; i < files.size(); ++i) {
+                for (const auto &d: PageBuilder::parse_directives(scripts[i])) {
+                    auto sect = PageBuilder::search_paths_of(d.cmd);
+                    if (sect) directives.push_back({sect, files[i].parent_path(), d.param});
+                }
+            }
+        }
+
+        Runner runner(opts);
+        runner.print_header();
+
+        //micro benchmarks
+        runner.run("micro/scan_directives", script_bytes, scripts.size(), [&]{
+            std::size_t cnt = 0;
+            for (const auto &s: scripts) cnt += PageBuilder::parse_directives(s).size();
+            if (cnt != directives.size()) throw std::runtime_error("unexpected count of directives");
+        });
+
+        auto resolve_all = [&](BuildCache &cache) {
+            for (const auto &d: directives) {
+                auto p = d.context / d.name;
+                if (!cache.is_regular_file(p)) p = prj.paths.find(d.section, d.name, cache);
+                if (p.empty()) ++warnings;
+            }
+        };
+        runner.run("micro/resolve_cold", 0, directives.size(), [&]{
+            BuildCache cache;
+            resolve_all(cache);
+        });
+        {
+            BuildCache cache;
+            runner.run("micro/resolve_warm", 0, directives.size(), [&]{
+                resolve_all(cache);
+            });
+        }
+
+        auto bench_filter = [&](std::string_view name, BuildCache::Filter flt, const std::vector<std::string> &src, std::uint64_t bytes) {
+            std::string out;
+            runner.run(name, bytes, src.size(), [&]{
+                for (const auto &s: src) {
+                    out.clear();
+                    PageBuilder::filter_content(flt, s, out);
+                }
+            });
+        };
+        bench_filter("micro/filter_css", BuildCache::Filter::css, styles, style_bytes);
+        bench_filter("micro/filter_js", BuildCache::Filter::js, scripts, script_bytes);
+        bench_filter("micro/filter_js_minify", BuildCache::Filter::js_minify, scripts, script_bytes);
+
+        //macro benchmarks
+        runner.run("macro/prepare_cold", script_bytes, scripts.size(), [&]{
+            PageBuilder bld(wout);
+            bld.prepare(prj.main, prj.paths);
+        });
+        {
+            PageBuilder bld(wout);
+            bld.prepare(prj.main, prj.paths);
+            runner.run("macro/prepare_nochange", 0, scripts.size(), [&]{
+                bld.prepare(prj.main, prj.paths);
+            });
+        }
+
+        struct ModeCase {
+            BuildMode mode;
+            bool minify;
+        };
+        for (auto m: {ModeCase{BuildMode::onefile, false}, ModeCase{BuildMode::onefile, true},
+                      ModeCase{BuildMode::copy, false}, ModeCase{BuildMode::hardlink, false},
+                      ModeCase{BuildMode::symlink, false}}) {
+            auto name = mode_name(m.mode) + (m.minify?"_minify":"");
+            auto target = opts.dir / ("out_" + name) / "index.html";
+            std::unique_ptr<PageBuilder> bld;
+            auto fresh = [&]{
+                std::filesystem::remove_all(target.parent_path());
+                bld = std::make_unique<PageBuilder>(wout);
+                bld->set_minify(m.minify);
+            };
+            auto build = [&]{
+                bld->prepare(prj.main, prj.paths);
+                bld->build(target, m.mode);
+            };
+            runner.run("macro/build_" + name + "_cold", script_bytes + style_bytes, scripts.size(), build, fresh);
+            fresh();
+            build();
+            runner.run("macro/build_" + name + "_nochange", 0, scripts.size(), build);
+        }
+
+        //server - clients aborting range requests in the middle of the transfer (resumed
+        //downloads, seeking). The server must survive and answer next requests
+        if (runner.selected("server/range_abort") || runner.selected("server/multirange_abort")) {
+            auto root = opts.dir / "serve";
+            std::filesystem::create_directories(root);
+            constexpr std::size_t file_size = 16*1024*1024;
+            std::ofstream(root / "big.bin", std::ios::out|std::ios::trunc|std::ios::binary) << std::string(file_size, 'x');
+            auto sock = opts.dir / "server.sock";
+            StaticFileHandler files(root);
+            HttpServer server(666, "unix:" + sock.string(), [&](HttpServer::Request &req){files(req);});
+            std::jthread thr([&](std::stop_token stop){server.run(stop, 2);});
+            auto abort_range = [&](std::string_view range) {
+                std::string req("GET /big.bin HTTP/1.1\r\nHost: bench\r\nRange: ");
+                req.append(range).append("\r\n\r\n");
+                http_request(sock, req, 256*1024);
+            };
+            runner.run("server/range_abort", 256*1024, 1, [&]{abort_range("bytes=1000-");});
+            runner.run("server/multirange_abort", 256*1024, 1, [&]{abort_range("bytes=1000-4000000,8000000-");});
+            auto resp = http_request(sock, "GET /big.bin HTTP/1.1\r\nHost: bench\r\nRange: bytes=0-99\r\nConnection: close\r\n\r\n", file_size);
+            if (resp.compare(0, 12, "HTTP/1.1 206") != 0) throw std::runtime_error("server doesn't respond after aborted transfers");
+        }
+
+        if (warnings) std::cerr << "Warnings reported: " << warnings << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << "FATAL: " << e.what() << std::endl;
+        if (!opts.keep) std::filesystem::remove_all(opts.dir);
+        return 2;
+    }
+    if (!opts.keep) std::filesystem::remove_all(opts.dir);
+    return 0;
+}
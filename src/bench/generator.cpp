@@ -0,0 +1,158 @@
+#include "generator.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+///deterministic generator (xorshift), std distributions differ between implementations
+class Random {
+public:
+    explicit Random(std::uint32_t seed):_state(seed?seed:1) {}
+    std::uint32_t next() {
+        _state ^= _state << 13;
+        _state ^= _state >> 17;
+        _state ^= _state << 5;
+        return _state;
+    }
+    ///random number in range 0..n-1
+    unsigned int operator()(unsigned int n) {return n?next() % n:0;}
+protected:
+    std::uint32_t _state;
+};
+
+}
+
+static void write_file(const std::filesystem::path &p, std::string_view content) {
+    std::ofstream f(p, std::ios::out|std::ios::trunc|std::ios::binary);
+    f.write(content.data(), content.size());
+    f.close();
+    if (!f) throw std::runtime_error("generate_project: failed to write " + p.string());
+}
+
+static std::string make_name(std::string_view prefix, unsigned int i, std::string_view ext) {
+    std::string out(prefix);
+    out.append(std::to_string(i)).append(ext);
+    return out;
+}
+static std::string script_name(unsigned int i) {return make_name("s", i, ".js");}
+static std::string style_name(unsigned int i) {return make_name("st", i, ".css");}
+static std::string resource_name(unsigned int i) {return make_name("r", i, ".png");}
+
+static void append_script_body(std::string &out, unsigned int idx, std::size_t size, Random &rnd) {
+    unsigned int blk = 0;
+    while (out.size() < size) {
+        out.append("// function number ").append(std::to_string(blk)).append(" of script ").append(std::to_string(idx)).append("\n");
+        out.append("/* block comment\n * with more lines\n */\n");
+        out.append("function f").append(std::to_string(idx)).append("_").append(std::to_string(blk)).append("(a, b) {\n");
+        out.append("    var s = \"string // not a comment, \\\"quoted\\\" /* neither */\";\n");
+        out.append("    var r = /ab+c\\/d[/]/g;\n");
+        out.append("    var t = `template ${a + b} // text`;\n");
+        out.append("    if (a < b && b > ").append(std::to_string(rnd(1000))).append(") {\n");
+        out.append("        return a / 2 + b / 3; // division, not regexp\n");
+        out.append("    }\n");
+        out.append("    return s.length + r.lastIndex + t.length;\n");
+        out.append("}\n\n");
+        ++blk;
+    }
+}
+
+static void append_style_body(std::string &out, unsigned int idx, std::size_t size, Random &rnd) {
+    unsigned int blk = 0;
+    while (out.size() < size) {
+        out.append("/* rule ").append(std::to_string(blk)).append(" */\n");
+        out.append(".c").append(std::to_string(idx)).append("_").append(std::to_string(blk)).append(" > div,\n");
+        out.append("    .d").append(std::to_string(idx)).append(" span {\n");
+        out.append("    margin: ").append(std::to_string(rnd(20))).append("px  auto;\n");
+        out.append("    font-family: \"Some Font\" , sans-serif;\n");
+        out.append("    background: url('img/back.png')   no-repeat;\n");
+        out.append("}\n\n");
+        ++blk;
+    }
+}
+
+GeneratedProject generate_project(const std::filesystem::path &root, const ProjectParams &params) {
+    Random rnd(params.seed);
+    GeneratedProject prj;
+    prj.root = std::filesystem::absolute(root);
+    std::filesystem::remove_all(prj.root);
+    std::filesystem::create_directories(prj.root);
+
+    unsigned int npaths = std::max(1U, params.search_paths);
+    for (unsigned int i = 0; i < npaths; ++i) {
+        auto dir = prj.root / make_name("lib", i, "");
+        std::filesystem::create_directories(dir);
+        prj.paths.scripts.push_back(dir);
+    }
+    auto css_dir = prj.root / "css";
+    auto res_dir = prj.root / "res";
+    std::filesystem::create_directories(css_dir);
+    std::filesystem::create_directories(res_dir);
+    prj.paths.styles.push_back(css_dir);
+    prj.paths.resources.push_back(res_dir);
+
+    //tree of requires: children of script i are (i+1)*fanout .. (i+1)*fanout+fanout-1,
+    //main script requires first fanout scripts
+    unsigned int n = params.scripts;
+    unsigned int fanout = std::max(1U, params.fanout);
+    std::vector<unsigned int> level(n, 0);
+    std::vector<std::vector<unsigned int> > deps(n);
+    std::vector<bool> reached(n, false);
+    std::vector<unsigned int> roots;
+    for (unsigned int i = 0; i < std::min(n, fanout); ++i) {
+        roots.push_back(i);
+        level[i] = 1;
+        reached[i] = true;
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        if (!reached[i] || level[i] >= params.depth) continue;
+        for (unsigned int k = 0; k < fanout; ++k) {
+            unsigned int c = (i+1)*fanout + k;
+            if (c >= n) break;
+            deps[i].push_back(c);
+            level[c] = level[i]+1;
+            reached[c] = true;
+        }
+    }
+    //shared dependencies - script requires a random script with higher index (no cycles)
+    for (unsigned int i = 0; i + 1 < n; ++i) {
+        if (rnd(4) == 0) deps[i].push_back(i + 1 + rnd(n - i - 1));
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        if (!reached[i]) roots.push_back(i);
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        std::string content;
+        for (auto r: deps[i]) content.append("//#require ").append(script_name(r)).append("\n");
+        if (params.styles) content.append("//#style ").append(style_name(i % params.styles)).append("\n");
+        if (params.resources) content.append("//#resource ").append(resource_name(i % params.resources)).append("\n");
+        append_script_body(content, i, params.script_size, rnd);
+        auto p = prj.paths.scripts[i % npaths] / script_name(i);
+        write_file(p, content);
+        prj.scripts.push_back(p);
+    }
+    for (unsigned int i = 0; i < params.styles; ++i) {
+        std::string content;
+        append_style_body(content, i, params.style_size, rnd);
+        auto p = css_dir / style_name(i);
+        write_file(p, content);
+        prj.styles.push_back(p);
+    }
+    for (unsigned int i = 0; i < params.resources; ++i) {
+        std::string content;
+        content.reserve(params.resource_size);
+        while (content.size() < params.resource_size) content.push_back(static_cast<char>(rnd.next() & 0xFF));
+        write_file(res_dir / resource_name(i), content);
+    }
+    //resources not referenced by scripts are referenced by main
+    std::string main;
+    for (auto r: roots) main.append("//#require ").append(script_name(r)).append("\n");
+    for (unsigned int i = n; i < params.resources; ++i) main.append("//#resource ").append(resource_name(i)).append("\n");
+    for (unsigned int i = n; i < params.styles; ++i) main.append("//#style ").append(style_name(i)).append("\n");
+    main.append("function main() {\n    return 0;\n}\n");
+    prj.main = prj.root / "main.js";
+    write_file(prj.main, main);
+    return prj;
+}
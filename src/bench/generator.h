@@ -0,0 +1,65 @@
+#pragma once
+#ifndef _builder_src_generator_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_generator_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <builder.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+///Parameters of the synthetic project
+struct ProjectParams {
+    ///count of scripts (without main script)
+    unsigned int scripts = 200;
+    ///maximum depth of require chains
+    unsigned int depth = 4;
+    ///count of scripts required by each script
+    unsigned int fanout = 4;
+    ///approximate size of each script in bytes
+    std::size_t script_size = 4096;
+    ///count of styles
+    unsigned int styles = 50;
+    ///approximate size of each style in bytes
+    std::size_t style_size = 2048;
+    ///count of search paths for scripts (scripts are distributed among them)
+    unsigned int search_paths = 4;
+    ///count of resources
+    unsigned int resources = 100;
+    ///size of each resource in bytes
+    std::size_t resource_size = 4096;
+    ///seed of the pseudo random generator
+    std::uint32_t seed = 1;
+};
+
+///Generated project
+struct GeneratedProject {
+    ///root directory
+    std::filesystem::path root;
+    ///main script
+    std::filesystem::path main;
+    ///search paths
+    SearchPaths paths;
+    ///all scripts
+    std::vector<std::filesystem::path> scripts;
+    ///all styles
+    std::vector<std::filesystem::path> styles;
+};
+
+///Generate synthetic project
+/**
+ * The project is deterministic - the same parameters always generate the same files. Scripts
+ * form a tree of requires with given depth and fan-out, additionally some scripts require
+ * random scripts from deeper levels, so the graph has shared nodes. Scripts not reachable through
+ * the tree are required by the main script. Content of scripts contains comments, strings, regular
+ * expressions and template literals, so filters are exercised
+ *
+ * @param root root directory, it is created. Existing content is removed
+ * @param params parameters
+ * @return generated project
+ */
+GeneratedProject generate_project(const std::filesystem::path &root, const ProjectParams &params);
+
+
+#endif
@@ -1,17 +1,279 @@
 #include "builder.h"
+#include "scan.h"
+#include "jsminify.h"
+#include "compress.h"
+#include "embed.h"
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <fstream>
+#include <sstream>
 #include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
 
-std::filesystem::path SearchPaths::find(List SearchPaths::*where, std::string_view name) const {
+const std::array<PageBuilder::Section, 6> PageBuilder::_sections = {{
+    {"require", &SearchPaths::scripts, &PageBuilder::_scripts},
+    {"style", &SearchPaths::styles, &PageBuilder::_styles},
+    {"page", &SearchPaths::page_fragments, &PageBuilder::_page_fragments},
+    {"template", &SearchPaths::page_templates, &PageBuilder::_page_templates},
+    {"header", &SearchPaths::header_fragments, &PageBuilder::_header_fragments},
+    {"resource", &SearchPaths::resources, &PageBuilder::_resources},
+}};
+
+std::size_t PageBuilder::find_section(std::string_view directive) {
+    std::size_t i = 0;
+    while (i < _sections.size() && _sections[i].directive != directive) ++i;
+    return i;
+}
+
+SearchPaths::List SearchPaths::*PageBuilder::search_paths_of(std::string_view directive) {
+    auto idx = find_section(directive);
+    return idx == _sections.size()?nullptr:_sections[idx].paths;
+}
+
+FileStamp FileStamp::get(const std::filesystem::path &p) {
+    BuildProfiler::count(BuildProfiler::Counter::stat);
+    struct stat st;
+    if (::stat(p.c_str(), &st)) return {};
+    return {
+        static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+        static_cast<std::uintmax_t>(st.st_size)
+    };
+}
+
+std::filesystem::path SearchPaths::find(List SearchPaths::*where, std::string_view name, BuildCache &cache) const {
     for (const auto &p : (this->*where)) {
         std::filesystem::path q = p/name;
-        if (std::filesystem::is_regular_file(q)) {
+        if (cache.is_regular_file(q)) {
             return q;
         }
     }
     return {};
 }
 
+///find first occurrence of any of specified characters
+template<char ... chars>
+static const char *find_special(const char *b, const char *e) {
+    static constexpr char set[] = {chars...};
+    static constexpr ScanSet scan_set(std::string_view(set, sizeof(set)));
+    return scan_first_of(scan_set, b, e);
+}
+
+///FNV-1a hash of the content, used for fingerprints
+static std::uint64_t fnv1a(std::string_view data) {
+    std::uint64_t h = 14695981039346656037ULL;
+    for (char c: data) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+///convert hash to hex, longer hashes are folded
+static std::string to_hex(std::uint64_t h, int digits) {
+    static constexpr char hex[] = "0123456789abcdef";
+    if (digits < 16) h ^= h >> (digits * 4);
+    std::string out(digits, '0');
+    for (int i = digits - 1; i >= 0; --i, h >>= 4) out[i] = hex[h & 0xF];
+    return out;
+}
+
+///Run fn(i) for i in 0..count-1 on a pool of threads, returns when all calls are finished
+static void parallel_for(std::size_t count, const std::function<void(std::size_t)> &fn) {
+    //tasks block on I/O, so there is at-least few threads even on single CPU
+    std::size_t threads = std::min<std::size_t>(count, std::max(4U, std::thread::hardware_concurrency()));
+    std::atomic<std::size_t> next = 0;
+    std::mutex lock;
+    std::exception_ptr error;
+    auto worker = [&]{
+        for (std::size_t i = next++; i < count; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard _(lock);
+                if (!error) error = std::current_exception();
+            }
+        }
+    };
+    {
+        std::vector<std::jthread> pool;
+        for (std::size_t i = 1; i < threads; ++i) pool.emplace_back(worker);
+        worker();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+///read whole file to the buffer
+static bool read_file(const std::filesystem::path &fname, std::string &buffer) {
+    std::ifstream f(fname, std::ios::in|std::ios::binary);
+    if (!f) return false;
+    f.seekg(0, std::ios::end);
+    auto sz = f.tellg();
+    f.seekg(0, std::ios::beg);
+    if (sz < 0) return false;
+    buffer.resize(static_cast<std::size_t>(sz));
+    f.read(buffer.data(), sz);
+    buffer.resize(static_cast<std::size_t>(f.gcount()));
+    BuildProfiler::count(BuildProfiler::Counter::file_read);
+    BuildProfiler::count(BuildProfiler::Counter::bytes_read, buffer.size());
+    return true;
+}
+
+std::filesystem::path PageBuilder::temp_file(const std::filesystem::path &fname) {
+    //concurrent builds (other processes, threads of the same process) must not share the file
+    static std::atomic<unsigned int> counter = 0;
+    std::string name(".");
+    name.append(fname.filename().string())
+        .append(".").append(std::to_string(::getpid()))
+        .append(".").append(std::to_string(counter++))
+        .append(".tmp");
+    return fname.parent_path() / name;
+}
+
+bool PageBuilder::write_file(const std::filesystem::path &fname, std::string_view data) {
+    auto tmp = temp_file(fname);
+    std::ofstream out(tmp, std::ios::out|std::ios::trunc|std::ios::binary);
+    out.write(data.data(), data.size());
+    out.close();
+    BuildProfiler::count(BuildProfiler::Counter::file_written);
+    BuildProfiler::count(BuildProfiler::Counter::bytes_written, data.size());
+    std::error_code ec;
+    if (out) std::filesystem::rename(tmp, fname, ec);
+    if (!out || ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+static bool write_compressed(const std::filesystem::path &fname, std::string_view data)
+{
+    BuildProfiler::Span _("compress", fname.native());
+    return PageBuilder::write_file(fname, gzip_compress(data));
+}
+
+BuildCache::Directives PageBuilder::parse_directives(std::string_view buffer) {
+    BuildCache::Directives out;
+    const char *beg = buffer.data();
+    const char *end = beg + buffer.size();
+    const char *counted = beg;
+    int line_number=1;
+    const char *pos = beg;
+    //search for //# at the beginning of line (only whitespaces can precede it)
+    while ((pos = find_special<'#'>(pos, end)) != end) {
+        const char *hash = pos++;
+        if (hash - beg < 2 || hash[-1] != '/' || hash[-2] != '/') continue;
+        const char *line_beg = hash - 2;
+        while (line_beg != beg && line_beg[-1] != '\n' && std::isspace(static_cast<unsigned char>(line_beg[-1]))) --line_beg;
+        if (line_beg != beg && line_beg[-1] != '\n') continue;
+        const char *line_end = find_special<'\n'>(hash, end);
+        line_number += static_cast<int>(std::count(counted, line_beg, '\n'));
+        counted = line_beg;
+        pos = line_end;
+        std::string_view line(hash - 2, line_end - hash + 2);
+        auto cmdline = line.substr(3);
+        auto sep = cmdline.find(' ');
+        if (sep != cmdline.npos) {
+            auto cmd = cmdline.substr(0,sep);
+            auto param = cmdline.substr(sep+1);
+            while (!param.empty() && std::isspace(param.front())) param = param.substr(1);
+            while (!param.empty() && std::isspace(param.back())) param = param.substr(0,param.size()-1);
+            if (param.size()>1 && param.front() == '"' && param.back() == '"') {
+                param = param.substr(1, param.size()-2);
+            }
+            out.push_back({std::string(cmd), std::string(param), line_number});
+        }
+    }
+    return out;
+}
+
+BuildCache::Content BuildCache::content(const std::filesystem::path &file) {
+    auto st = FileStamp::get(file);
+    {
+        std::lock_guard _(_lock);
+        auto iter = _sources.find(file);
+        if (iter != _sources.end() && iter->second.stamp == st) return iter->second.value;
+    }
+    std::string data;
+    if (!read_file(file, data)) return nullptr;
+    auto value = std::make_shared<const std::string>(std::move(data));
+    std::lock_guard _(_lock);
+    _sources[file] = {st, value};
+    return value;
+}
+
+std::shared_ptr<const BuildCache::Directives> BuildCache::directives(const std::filesystem::path &file, const std::function<Directives()> &parse) {
+    auto st = FileStamp::get(file);
+    {
+        std::lock_guard _(_lock);
+        auto iter = _directives.find(file);
+        if (iter != _directives.end() && iter->second.stamp == st) return iter->second.value;
+    }
+    auto value = std::make_shared<const Directives>(parse());
+    std::lock_guard _(_lock);
+    _directives[file] = {st, value};
+    return value;
+}
+
+BuildCache::Content BuildCache::filtered(const std::filesystem::path &file, Filter filter, const std::function<bool(std::string &)> &make) {
+    auto &map = _filtered[static_cast<int>(filter)];
+    auto st = FileStamp::get(file);
+    {
+        std::lock_guard _(_lock);
+        auto iter = map.find(file);
+        if (iter != map.end() && iter->second.stamp == st) return iter->second.value;
+    }
+    std::string data;
+    if (!make(data)) return nullptr;
+    auto value = std::make_shared<const std::string>(std::move(data));
+    std::lock_guard _(_lock);
+    map[file] = {st, value};
+    return value;
+}
+
+BuildCache::Entry<std::unordered_set<std::string> > BuildCache::read_dir(const std::filesystem::path &dir) {
+    //stamp is taken first, so a change made during reading is detected by next refresh
+    BuildProfiler::Span _("index", dir.native());
+    BuildProfiler::count(BuildProfiler::Counter::dir_read);
+    Entry<std::unordered_set<std::string> > out;
+    out.stamp = FileStamp::get(dir);
+    std::error_code ec;
+    for (std::filesystem::directory_iterator iter(dir, ec), end; !ec && iter != end; iter.increment(ec)) {
+        std::error_code ec2;
+        if (iter->is_regular_file(ec2)) out.value.insert(iter->path().filename().string());
+    }
+    return out;
+}
+
+bool BuildCache::is_regular_file(const std::filesystem::path &file) {
+    auto dir = file.parent_path();
+    auto name = file.filename().string();
+    {
+        std::lock_guard _(_lock);
+        auto iter = _dirs.find(dir);
+        if (iter != _dirs.end()) return iter->second.value.count(name) != 0;
+    }
+    auto entry = read_dir(dir);
+    bool r = entry.value.count(name) != 0;
+    std::lock_guard _(_lock);
+    _dirs.emplace(dir, std::move(entry));
+    return r;
+}
+
+std::uint64_t BuildCache::refresh_index() {
+    std::lock_guard _(_lock);
+    for (auto &[dir, entry]: _dirs) {
+        if (FileStamp::get(dir) != entry.stamp) {
+            entry = read_dir(dir);
+            ++_dirs_version;
+        }
+    }
+    return _dirs_version;
+}
+
 bool PageBuilder::process_file(const std::filesystem::path & src_file, const SearchPaths &paths)
 {
     std::filesystem::path context_dir = src_file.parent_path();;
@@ -19,84 +281,79 @@ bool PageBuilder::process_file(const std::filesystem::path & src_file, const Sea
     auto r = _processed.insert(src_file);
     if (!r.second) return false;
 
-    std::string buffer;
-    std::ifstream in(src_file);
-    int line_number=0;
-    while (!!in) {
-        std::getline(in, buffer);
-        ++line_number;
-        std::string_view line = buffer;
-        while (!line.empty() && std::isspace(line.front())) line = line.substr(1);
-        if (line.compare(0,3,"//#") == 0) {
-            auto cmdline = line.substr(3);
-            auto sep = cmdline.find(' ');
-            if (sep != cmdline.npos) {
-                auto cmd = cmdline.substr(0,sep);
-                auto param = cmdline.substr(sep+1);
-                while (!param.empty() && std::isspace(param.front())) param = param.substr(1);
-                while (!param.empty() && std::isspace(param.back())) param = param.substr(0,param.size()-1);
-                if (param.size()>1 && param.front() == '"' && param.back() == '"') {
-                    param = param.substr(1, param.size()-2);
-                }
-                
-                std::filesystem::path p;
-                SearchPaths::List SearchPaths::*section;
-                OpenedResources PageBuilder::*resource;
-                if (cmd == "require") {
-                    section = &SearchPaths::scripts;
-                    resource = &PageBuilder::_scripts;
-                } else if (cmd == "style") {
-                    section = &SearchPaths::styles;
-                    resource = &PageBuilder::_styles;
-                } else if (cmd == "page") {
-                    section = &SearchPaths::page_fragments;
-                    resource = &PageBuilder::_page_fragments;
-                } else if (cmd == "template") {
-                    section = &SearchPaths::page_templates;
-                    resource = &PageBuilder::_page_templates;
-                } else if (cmd == "header") {
-                    section = &SearchPaths::header_fragments;
-                    resource = &PageBuilder::_header_fragments;
-                } else if (cmd == "resource") {
-                    section = &SearchPaths::resources;
-                    resource = &PageBuilder::_resources;
-                } else {
-                    _warning(src_file, line_number, std::string("Unknown directive: ").append(cmd).append(". Only allowed: require, style, page, template, header, resource"));
-                    continue;
-                }
+    auto directives = _cache->directives(src_file, [&]{
+        BuildProfiler::Span _("scan", src_file.native());
+        auto data = _cache->content(src_file);
+        return data?parse_directives(*data):BuildCache::Directives();
+    });
+    for (const auto &d: *directives) {
+        std::string_view cmd = d.cmd;
+        std::string_view param = d.param;
+        int line_number = d.line;
+        std::filesystem::path p;
+        auto idx = find_section(cmd);
+        if (idx == _sections.size()) {
+            std::string msg("Unknown directive: ");
+            msg.append(cmd).append(". Only allowed: ");
+            for (const auto &s: _sections) {
+                if (&s != &_sections.front()) msg.append(", ");
+                msg.append(s.directive);
+            }
+            _warning(src_file, line_number, std::move(msg));
+            continue;
+        }
+        auto section = _sections[idx].paths;
+        auto resource = _sections[idx].resource;
 
-                p = context_dir/param;
-                if (!std::filesystem::is_regular_file(p)) {
-                    p = paths.find(section, param);
-                }
+        std::string key (cmd);
+        key.append(1, '\0').append(context_dir.native()).append(1, '\0').append(param);
+        auto res_iter = _resolved.find(key);
+        if (res_iter != _resolved.end()) {
+            p = res_iter->second;
+        } else {
+            BuildProfiler::Span _("resolve", param);
+            p = context_dir/param;
+            if (!_cache->is_regular_file(p)) {
+                p = paths.find(section, param, *_cache);
+            }
+            _resolved.emplace(std::move(key), p);
+        }
+        //file added later to any directory searched before the found one (for example a subdirectory
+        //of the search path, which is not recorded otherwise) changes the result
+        auto local = context_dir/param;
+        _graph.emplace(local.parent_path(), FileStamp());
+        if (p != local) {
+            for (const auto &dir: paths.*section) {
+                auto q = dir/param;
+                _graph.emplace(q.parent_path(), FileStamp());
+                if (q == p) break;
+            }
+        }
 
-                if (p == std::filesystem::path()) {
-                    _warning(src_file, line_number, std::string("Linked resource was not found: ").append(param));                    
-                    continue;
-                }
+        if (p == std::filesystem::path()) {
+            _warning(src_file, line_number, std::string("Linked resource was not found: ").append(param));                    
+            continue;
+        }
 
 
-                bool include_file = true;
-                if (resource == &PageBuilder::_scripts) {
-                    include_file = process_file(p, paths);
-                }
+        bool include_file = true;
+        if (resource == &PageBuilder::_scripts) {
+            include_file = process_file(p, paths);
+        }
 
-                ++index;
-
-                if (include_file) {
-                    auto iter = (this->*resource).find(p);
-                    if (iter == (this->*resource).end()) {
-                        std::string trg ( param);
-                        if (!_allocated.insert(trg).second) {
-                            auto dot = trg.rfind('.');
-                            if (dot == trg.npos) dot = trg.size();
-                            trg = trg.substr(0,dot)+"."+std::to_string(index)+trg.substr(dot);
-                            _allocated.insert(trg);
-                        }
-                        (this->*resource).insert(OpenedResources::value_type(p, {trg, index}));
-                    }
-                }
+        ++index;
 
+        if (include_file) {
+            auto iter = (this->*resource).find(p);
+            if (iter == (this->*resource).end()) {
+                std::string trg ( param);
+                if (!_allocated.insert(trg).second) {
+                    auto dot = trg.rfind('.');
+                    if (dot == trg.npos) dot = trg.size();
+                    trg = trg.substr(0,dot)+"."+std::to_string(index)+trg.substr(dot);
+                    _allocated.insert(trg);
+                }
+                (this->*resource).insert(OpenedResources::value_type(p, {trg, index}));
             }
         }
     }
@@ -105,43 +362,411 @@ bool PageBuilder::process_file(const std::filesystem::path & src_file, const Sea
 
 void PageBuilder::prepare(const std::filesystem::path &src_file, const SearchPaths &paths)
 {
+    BuildProfiler::Span _("phase", "prepare");
+    if (_source == src_file && _search == paths && !graph_changed()) {
+        return;
+    }
+
+    std::array<OpenedResources, _sections.size()> prev;
+    for (std::size_t i = 0; i < _sections.size(); ++i) {
+        prev[i] = std::move(this->*_sections[i].resource);
+        (this->*_sections[i].resource).clear();
+    }
+
+    //directories are read once, lookups are reused until any of them changes
+    auto version = _cache->refresh_index();
+    if (version != _resolved_version || !(_search == paths)) {
+        _resolved.clear();
+        _resolved_version = version;
+    }
+
     index=0;
-    _page_fragments.clear();
-    _header_fragments.clear();
-    _scripts.clear();
-    _styles.clear();
-    _resources.clear();
     _processed.clear();
     _allocated.clear();
-    
+    _graph.clear();
+    _source = src_file;
+    _search = paths;
+
     process_file(src_file, paths);
-    _scripts.insert(OpenedResources::value_type(src_file, {src_file.filename(), index}));
+    _scripts.insert(OpenedResources::value_type(src_file, {src_file.filename(), ++index}));
+
+    //searched directories are stamped after processing, like the files
+    for (auto &[p, st]: _graph) st = FileStamp::get(p);
+    for (const auto &p: _processed) {
+        _graph.emplace(p, FileStamp::get(p));
+        auto dir = std::filesystem::path(p).parent_path();
+        _graph.emplace(dir, FileStamp::get(dir));
+    }
+    for (const auto &s: _sections) {
+        for (const auto &dir: paths.*s.paths) {
+            _graph.emplace(dir, FileStamp::get(dir));
+        }
+    }
+
+    for (std::size_t i = 0; i < _sections.size() && !_graph_changed; ++i) {
+        _graph_changed = prev[i] != this->*_sections[i].resource;
+    }
+}
+
+bool PageBuilder::graph_changed() const {
+    if (_graph.empty()) return true;
+    for (const auto &[p, st]: _graph) {
+        if (FileStamp::get(p) != st) return true;
+    }
+    return false;
+}
+
+bool PageBuilder::is_changed(const std::filesystem::path &src) const {
+    auto a = _built.find(src);
+    auto b = _stamps.find(src);
+    return a == _built.end() || b == _stamps.end() || a->second != b->second;
 }
 
-void PageBuilder::build(const std::filesystem::path &target_html, BuildMode mode)
+bool PageBuilder::is_changed(OpenedResources PageBuilder::*container) const {
+    for (const auto &[src, trg]: (this->*container)) {
+        if (is_changed(src)) return true;
+    }
+    return false;
+}
+
+void PageBuilder::build(const std::filesystem::path &target_html, BuildMode mode, bool write_page)
 {
     auto parent = target_html.parent_path();
     std::filesystem::create_directories(parent);
-    build_page(target_html,mode);
-    if (mode  != BuildMode::onefile) {
-        link_container_files(&PageBuilder::_styles, parent, mode);
-        link_container_files(&PageBuilder::_scripts, parent, mode);
+
+    _stamps.clear();
+    for (const auto &s: _sections) {
+        for (const auto &[src, trg]: this->*s.resource) {
+            _stamps.emplace(src, FileStamp::get(src));
+        }
+    }
+
+    bool force = _graph_changed || _built_target != target_html || _built_mode != mode
+            || (mode == BuildMode::onefile && _built_minify != _minify)
+            || _built_compress != _compress
+            || _built_fingerprint != _fingerprint
+            || _built_chunks != chunk_names();
+    bool names_changed;
+    //files with previous names are removed after the page is published
+    std::vector<std::filesystem::path> outdated;
+    {
+        BuildProfiler::Span _("phase", "hash");
+        names_changed = update_hashes(parent, mode, outdated);
+    }
+    std::error_code ec;
+    //in embed mode, the page is written as a part of the generated source
+    auto page_file = mode == BuildMode::embed?embed_source_path(target_html):target_html;
+    bool page_dirty = force || names_changed
+            || (write_page?!_page_written || !std::filesystem::exists(page_file, ec):!_page)
+            || is_changed(&PageBuilder::_header_fragments)
+            || is_changed(&PageBuilder::_page_fragments)
+            || is_changed(&PageBuilder::_page_templates)
+            || (mode == BuildMode::onefile && (is_changed(&PageBuilder::_styles) || is_changed(&PageBuilder::_scripts)));
+
+    if (page_dirty) {
+        BuildProfiler::Span _("phase", "render");
+        std::ostringstream buffer;
+        build_page(buffer, mode);
+        _page = std::make_shared<const std::string>(std::move(buffer).str());
+        _page_written = false;
+        _page_version = calc_page_version(mode);
+    }
+    if (mode != BuildMode::embed) {
+        BuildProfiler::Span _("phase", "link");
+        std::vector<LinkTask> tasks;
+        if (mode  != BuildMode::onefile) {
+            plan_links(&PageBuilder::_styles, parent, mode, force, _compress, tasks);
+            plan_links(&PageBuilder::_scripts, parent, mode, force, _compress, tasks);
+        }
+        plan_links(&PageBuilder::_resources, parent, mode, force, false, tasks);
+        //directories are created before, so the tasks don't race on them
+        std::unordered_set<std::filesystem::path> dirs;
+        for (const auto &t: tasks) {
+            auto dir = t.target.parent_path();
+            if (dirs.insert(dir).second) std::filesystem::create_directories(dir);
+        }
+        parallel_for(tasks.size(), [&](std::size_t i){
+            run_link(tasks[i], mode);
+        });
+        for (const auto &t: tasks) {
+            for (const auto &[f, msg]: t.warnings) _warning(f, 0, msg);
+        }
+    }
+
+    //linked files are in place, so the page referring them can be published
+    if (mode == BuildMode::embed) {
+        //content of linked files is part of the generated source
+        if (is_changed(&PageBuilder::_styles) || is_changed(&PageBuilder::_scripts)
+                || is_changed(&PageBuilder::_resources)) _page_written = false;
+        if (write_page && !_page_written) {
+            BuildProfiler::Span _("phase", "embed");
+            _page_written = write_embedded(target_html);
+        }
+    } else if (write_page && !_page_written) {
+        BuildProfiler::Span _("phase", "write");
+        if (!write_file(target_html, *_page)) {
+            _warning(target_html, 0, "Failed to write page");
+        } else {
+            auto gzname = target_html;
+            gzname += ".gz";
+            if (!_compress) {
+                std::filesystem::remove(gzname, ec);
+                _page_written = true;
+            } else if (write_compressed(gzname, *_page)) {
+                _page_written = true;
+            } else {
+                _warning(gzname, 0, "Failed to write compressed file");
+            }
+        }
     }
-    link_container_files(&PageBuilder::_resources, parent, mode);
+    for (const auto &f: outdated) std::filesystem::remove(f, ec);
+
+    _built = std::move(_stamps);
+    _stamps.clear();
+    _built_target = target_html;
+    _built_mode = mode;
+    _built_minify = _minify;
+    _built_compress = _compress;
+    _built_fingerprint = _fingerprint;
+    _built_chunks = chunk_names();
+    _graph_changed = false;
+    save_state(target_html);
+}
+
+void PageBuilder::set_chunks(Chunks scripts, Chunks styles) {
+    _script_chunks = std::move(scripts);
+    _style_chunks = std::move(styles);
+    _chunked.clear();
+    for (const auto *lst: {&_script_chunks, &_style_chunks}) {
+        for (const auto &c: *lst) _chunked.insert(c.files.begin(), c.files.end());
+    }
+}
+
+std::vector<std::string> PageBuilder::chunk_names() const {
+    std::vector<std::string> out;
+    for (const auto *lst: {&_style_chunks, &_script_chunks}) {
+        for (const auto &c: *lst) out.push_back(c.name);
+    }
+    return out;
+}
+
+std::vector<std::filesystem::path> PageBuilder::get_inputs() const {
+    std::vector<std::filesystem::path> out;
+    for (const auto &s: _sections) {
+        for (const auto &[src, trg]: this->*s.resource) out.push_back(src);
+    }
+    return out;
+}
+
+std::vector<std::filesystem::path> PageBuilder::get_search_dirs() const {
+    std::vector<std::filesystem::path> out;
+    for (const auto &s: _sections) {
+        const auto &lst = _search.*s.paths;
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    //also directories searched for the directives (graph contains files and directories)
+    for (const auto &[p, st]: _graph) {
+        std::error_code ec;
+        if (std::filesystem::is_directory(p, ec)) out.push_back(p);
+    }
+    return out;
+}
+
+std::vector<PageBuilder::BuiltAsset> PageBuilder::get_assets() const {
+    std::vector<BuiltAsset> out;
+    if (_built_target.empty()) return out;
+    auto parent = _built_target.parent_path();
+    for (const auto *lst: {&_style_chunks, &_script_chunks}) {
+        for (const auto &c: *lst) {
+            if (c.content) out.push_back({parent / c.name, false, false, c.content});
+            else out.push_back({parent / c.name, _built_compress, true});
+        }
+    }
+    if (_built_mode == BuildMode::embed) return out;
+    for (auto container: {&PageBuilder::_styles, &PageBuilder::_scripts, &PageBuilder::_resources}) {
+        if (_built_mode == BuildMode::onefile && container != &PageBuilder::_resources) continue;
+        bool compress = _built_compress && container != &PageBuilder::_resources;
+        for (const auto &[src, trg]: this->*container) {
+            if (_chunked.count(src)) continue;
+            auto fulltrg = parent / target_name(src, trg.first);
+            bool generated = fulltrg != src;
+            out.push_back({std::move(fulltrg), compress, generated});
+        }
+    }
+    return out;
+}
+
+std::vector<std::filesystem::path> PageBuilder::get_outputs() const {
+    std::vector<std::filesystem::path> out;
+    auto add = [&](std::filesystem::path p, bool compress) {
+        if (compress) {
+            auto gz = p;
+            gz += ".gz";
+            out.push_back(std::move(gz));
+        }
+        out.push_back(std::move(p));
+    };
+    if (_built_mode == BuildMode::embed) {
+        out = get_page_outputs();
+    } else if (!_built_target.empty()) {
+        add(_built_target, _built_compress);
+    }
+    for (const auto &a: get_assets()) {
+        if (a.generated) add(a.file, a.compressed);
+    }
+    return out;
+}
+
+std::vector<std::filesystem::path> PageBuilder::get_page_outputs() const {
+    if (_built_target.empty()) return {};
+    if (_built_mode == BuildMode::embed) return {embed_header_path(_built_target), embed_source_path(_built_target)};
+    return {_built_target};
+}
+
+std::filesystem::path PageBuilder::state_file(const std::filesystem::path &target_html) {
+    std::string name(".");
+    name.append(target_html.filename().string()).append(".deps");
+    return target_html.parent_path() / name;
 }
 
+static constexpr std::string_view state_header = "webproject-state 2";
 
-struct EmptyFilter {
-    char tmp;
-    std::string_view operator()(int c) {
-        if (c != EOF) {
-            tmp = c;
-            return std::string_view(&tmp, 1);
+void PageBuilder::save_state(const std::filesystem::path &target_html) {
+    auto fname = state_file(target_html);
+    std::ofstream out(fname, std::ios::out|std::ios::trunc);
+    out << state_header << "\n";
+    out << "mode\t" << static_cast<int>(_built_mode) << "\n";
+    out << "minify\t" << (_built_minify?1:0) << "\n";
+    out << "compress\t" << (_built_compress?1:0) << "\n";
+    out << "fingerprint\t" << (_built_fingerprint?1:0) << "\n";
+    out << "written\t" << (_page_written?1:0) << "\n";
+    out << "target\t" << _built_target.string() << "\n";
+    out << "source\t" << _source.string() << "\n";
+    for (const auto &s: _sections) {
+        for (const auto &p: _search.*s.paths) {
+            out << "search\t" << s.directive << "\t" << p.string() << "\n";
+        }
+    }
+    for (const auto &[p, st]: _graph) {
+        out << "graph\t" << st.mtime << "\t" << st.size << "\t" << p.string() << "\n";
+    }
+    for (const auto &[p, st]: _built) {
+        out << "built\t" << st.mtime << "\t" << st.size << "\t" << p.string() << "\n";
+    }
+    for (const auto &[p, h]: _hashes) {
+        out << "hash\t" << h << "\t" << p.string() << "\n";
+    }
+    for (const auto &c: _built_chunks) {
+        out << "chunk\t" << c << "\n";
+    }
+    for (const auto &s: _sections) {
+        for (const auto &[p, trg]: this->*s.resource) {
+            out << s.directive << "\t" << trg.second << "\t" << trg.first << "\t" << p.string() << "\n";
+        }
+    }
+    if (!out) {
+        _warning(fname, 0, "Failed to store build state");
+        out.close();
+        std::error_code ec;
+        std::filesystem::remove(fname, ec);
+    }
+}
+
+bool PageBuilder::load_state(const std::filesystem::path &target_html) {
+    std::ifstream in(state_file(target_html));
+    std::string line;
+    if (!std::getline(in, line) || line != state_header) return false;
+
+    std::filesystem::path source;
+    std::filesystem::path target;
+    BuildMode mode = BuildMode::onefile;
+    bool page_written = false;
+    bool minify = false;
+    bool compress = false;
+    bool fingerprint = false;
+    SearchPaths search;
+    Stamps graph;
+    Stamps built;
+    Hashes hashes;
+    std::vector<std::string> chunks;
+    std::array<OpenedResources, _sections.size()> res;
+
+    auto next_field = [](std::string_view &l) {
+        auto sep = l.find('\t');
+        auto r = l.substr(0, sep);
+        l = sep == l.npos?std::string_view():l.substr(sep+1);
+        return r;
+    };
+    auto to_int = [](std::string_view v) {
+        return std::strtoll(std::string(v).c_str(), nullptr, 10);
+    };
+
+    while (std::getline(in, line)) {
+        std::string_view l = line;
+        auto kind = next_field(l);
+        if (kind == "mode") {
+            mode = static_cast<BuildMode>(to_int(l));
+        } else if (kind == "minify") {
+            minify = to_int(l) != 0;
+        } else if (kind == "compress") {
+            compress = to_int(l) != 0;
+        } else if (kind == "fingerprint") {
+            fingerprint = to_int(l) != 0;
+        } else if (kind == "hash") {
+            std::string h(next_field(l));
+            hashes.emplace(l, std::move(h));
+        } else if (kind == "chunk") {
+            chunks.emplace_back(l);
+        } else if (kind == "written") {
+            page_written = to_int(l) != 0;
+        } else if (kind == "target") {
+            target = l;
+        } else if (kind == "source") {
+            source = l;
+        } else if (kind == "search") {
+            auto idx = find_section(next_field(l));
+            if (idx == _sections.size()) return false;
+            (search.*_sections[idx].paths).push_back(l);
+        } else if (kind == "graph" || kind == "built") {
+            FileStamp st;
+            st.mtime = to_int(next_field(l));
+            st.size = to_int(next_field(l));
+            (kind == "graph"?graph:built).emplace(l, st);
         } else {
-            return std::string_view();
+            auto idx = find_section(kind);
+            if (idx == _sections.size()) return false;
+            int index = static_cast<int>(to_int(next_field(l)));
+            std::string trg (next_field(l));
+            res[idx].insert(OpenedResources::value_type(l, {std::move(trg), index}));
         }
     }
-};
+    if (target != target_html || source.empty() || graph.empty()) return false;
+
+    for (std::size_t i = 0; i < _sections.size(); ++i) {
+        this->*_sections[i].resource = std::move(res[i]);
+    }
+    _processed.clear();
+    _allocated.clear();
+    for (const auto &[p, trg]: _scripts) _processed.insert(p);
+    _source = std::move(source);
+    _search = std::move(search);
+    _graph = std::move(graph);
+    _built = std::move(built);
+    _built_target = std::move(target);
+    _built_mode = mode;
+    _built_minify = minify;
+    _built_compress = compress;
+    _built_fingerprint = fingerprint;
+    _hashes = std::move(hashes);
+    _built_chunks = std::move(chunks);
+    _graph_changed = false;
+    _page_written = page_written;
+    return true;
+}
+
+//Filters process input by blocks. Every call of operator() appends filtered block to
+//the output, unchanged runs of text are appended at once. The function finish()
+//is called at the end of the input
 
 struct CSSFilter {
 
@@ -155,49 +780,80 @@ struct CSSFilter {
     Mode mode = text;
 
     char last = 0;
-    char buff[2];
-    std::string_view operator()(int c) {
+
+    void operator()(std::string_view in, std::string &out) {
+        const char *p = in.data();
+        const char *e = p + in.size();
+        while (p != e) {
+            switch (mode) {
+                case Mode::comment: {
+                    const char *q = find_special<'/'>(p, e);
+                    if (q != p) last = q[-1];
+                    p = q;
+                    if (p == e) break;
+                    ++p;
+                    if (last == '*') mode = text;
+                    last = 0;
+                } break;
+                case Mode::quotes: {
+                    const char *q = find_special<'"'>(p, e);
+                    if (q != p) {
+                        out.append(p, q);
+                        last = q[-1];
+                    }
+                    p = q;
+                    if (p == e) break;
+                    char c = *p++;
+                    if (last != '\\') mode = text;
+                    last = c;
+                    out.push_back(c);
+                } break;
+                case Mode::slash: {
+                    char c = *p++;
+                    switch (c) {
+                        case '/': last = c; out.push_back(c); break;
+                        case '*': last = 0; mode = comment; break;
+                        case '"': out.push_back('/'); out.push_back(c); mode = quotes; break;
+                        case '\n': last = '/'; mode = newline; out.push_back('/'); break;
+                        default: out.push_back('/'); out.push_back(c); mode = text; break;
+                    }
+                } break;
+                case Mode::newline: {
+                    char c = *p++;
+                    switch (c) {
+                        case '\n':
+                        case '\r': break;
+                        case '/': mode = slash; out.push_back('\n'); break;
+                        case '"': mode = quotes; out.push_back('\n'); break;
+                        default: mode = text; out.push_back('\n'); out.push_back(c); break;
+                    }
+                } break;
+                default:
+                case Mode::text: {
+                    const char *q = find_special<'/','\n','\r','"'>(p, e);
+                    if (q != p) {
+                        out.append(p, q);
+                        last = q[-1];
+                    }
+                    p = q;
+                    if (p == e) break;
+                    char c = *p++;
+                    switch (c) {
+                        case '/': mode = slash; break;
+                        case '\n':
+                        case '\r': mode = newline; break;
+                        default: last = c; mode = quotes; out.push_back(c); break;
+                    }
+                } break;
+            }
+        }
+    }
+
+    void finish(std::string &out) {
         switch (mode) {
-            case Mode::comment:
-                switch (c) {
-                    case EOF: return {};
-                    case '/': if (last == '*') mode = text; last = 0; return {};
-                    default: last = c; return {};
-                }
-            case Mode::quotes:
-                switch (c) {
-                    case EOF: return {};
-                    case '"': if (last != '\\') mode = text; last = c; return std::string_view(&last,1);
-                    default: last = c; return std::string_view(&last,1);
-                }
-            case Mode::slash:
-                switch (c) {
-                    case EOF: buff[0] = '/'; buff[1] = '\n'; return std::string_view(buff,2);
-                    case '/': last = c; return std::string_view(&last,1);
-                    case '*': last = 0; mode=comment;return {};
-                    case '"': buff[0] = '/'; buff[1] = c; mode = text; mode = quotes; return std::string_view(buff,2);
-                    case '\n':last = '/'; mode=newline; return std::string_view(&last,1);
-                    default: buff[0] = '/'; buff[1] = c; mode = text; return std::string_view(buff,2);
-                }
-            case Mode::newline:
-                switch (c) {
-                    case EOF: return {};
-                    case '\n':
-                    case '\r': return {};
-                    case '/': mode = slash; buff[0] = '\n'; return std::string_view(buff,1);
-                    case '"': mode = quotes; buff[0] = '\n';buff[1] = c; return std::string_view(buff,1);
-                    default: mode = text;buff[0] = '\n'; buff[1] = c; return std::string_view(buff,2);
-                }
-            default:
-            case Mode::text:
-                switch (c) {
-                    case EOF: last = '\n'; return std::string_view(&last,1);
-                    case '/': mode = slash;  return {};
-                    case '\n': 
-                    case '\r': mode = newline; return {};
-                    case '"': last = c; mode = quotes; return std::string_view(&last,1);
-                    default: last = c;  return std::string_view(&last,1);
-                }        
+            case Mode::slash: out.append("/\n"); break;
+            case Mode::text: last = '\n'; out.push_back('\n'); break;
+            default: break;
         }
     }
 };
@@ -217,97 +873,212 @@ struct JSFilter {
     Mode mode = text;
 
     char last = 0;
-    char buff[3];
-    std::string_view operator()(int c) {
-        int idx = 0;
+
+    void operator()(std::string_view in, std::string &out) {
+        const char *p = in.data();
+        const char *e = p + in.size();
+        while (p != e) {
+            switch (mode) {
+                case Mode::comment: {
+                    const char *q = find_special<'/'>(p, e);
+                    if (q != p) last = q[-1];
+                    p = q;
+                    if (p == e) break;
+                    ++p;
+                    if (last == '*') mode = text;
+                    last = 0;
+                } break;
+                case Mode::linecomment: {
+                    p = find_special<'\n'>(p, e);
+                    if (p == e) break;
+                    ++p;
+                    mode = newline;
+                } break;
+                case Mode::quotes:
+                case Mode::squotes: {
+                    const char *q = mode == Mode::quotes?find_special<'"'>(p, e):find_special<'\''>(p, e);
+                    if (q != p) {
+                        out.append(p, q);
+                        last = q[-1];
+                    }
+                    p = q;
+                    if (p == e) break;
+                    char c = *p++;
+                    if (last != '\\') mode = text;
+                    last = c;
+                    out.push_back(c);
+                } break;
+                case Mode::begslash:
+                case Mode::slash: {
+                    char c = *p++;
+                    switch (c) {
+                        case '/': mode = linecomment; break;
+                        case '*': last = 0; mode = comment; break;
+                        default:
+                            if (mode == Mode::begslash) out.push_back('\n');
+                            out.push_back('/');
+                            switch (c) {
+                                case '"': out.push_back(c); mode = quotes; break;
+                                case '\'': out.push_back(c); mode = squotes; break;
+                                case '\n': mode = newline; break;
+                                default: out.push_back(c); mode = text; break;
+                            }
+                            break;
+                    }
+                } break;
+                case Mode::newline: {
+                    char c = *p++;
+                    switch (c) {
+                        case ' ':
+                        case '\t':
+                        case '\n':
+                        case '\r': break;
+                        case '/': mode = begslash; break;
+                        case '"': mode = quotes; out.push_back('\n'); out.push_back(c); break;
+                        case '\'': mode = squotes; out.push_back('\n'); out.push_back(c); break;
+                        default: mode = text; out.push_back('\n'); out.push_back(c); break;
+                    }
+                } break;
+                default:
+                case Mode::text: {
+                    const char *q = find_special<'/','\n','\r','"','\''>(p, e);
+                    if (q != p) {
+                        out.append(p, q);
+                        last = q[-1];
+                    }
+                    p = q;
+                    if (p == e) break;
+                    char c = *p++;
+                    switch (c) {
+                        case '/': mode = slash; break;
+                        case '\n':
+                        case '\r': mode = newline; break;
+                        case '"': last = c; mode = quotes; out.push_back(c); break;
+                        default: last = c; mode = squotes; out.push_back(c); break;
+                    }
+                } break;
+            }
+        }
+    }
+
+    void finish(std::string &out) {
         switch (mode) {
-            case Mode::comment:
-                switch (c) {
-                    case EOF: return {};
-                    case '/': if (last == '*') mode = text; last = 0; return {};
-                    default: last = c; return {};
-                }
-            case Mode::linecomment:
-                switch (c) {
-                    case '\n': mode = newline; return {};
-                    default: return {};
-                }
-            case Mode::quotes:
-                switch (c) {
-                    case EOF: return {};
-                    case '"': if (last != '\\') mode = text; last = c; return std::string_view(&last,1);
-                    default: buff[0]='~'; buff[1] = last = c; return std::string_view(buff+1,1);
-                }
-            case Mode::squotes:
-                switch (c) {
-                    case EOF: return {};
-                    case '\'': if (last != '\\') mode = text; last = c; return std::string_view(&last,1);
-                    default: buff[0]='~'; buff[1] = last = c; return std::string_view(buff+1,1);
-                }
-            case Mode::begslash:            
-                buff[0] = '\n';
-                idx++;  
-                [[fallthrough]];
-
-            case Mode::slash:
-                switch (c) {
-                    case EOF: buff[idx] = '/'; buff[idx+1] = '\n'; return std::string_view(buff,idx+2);
-                    case '/': mode = linecomment;return {};
-                    case '*': last = 0; mode=comment;return {};
-                    case '"': buff[idx] = '/'; buff[idx+1] = c; mode = quotes; return std::string_view(buff,idx+2);
-                    case '\'': buff[idx] = '/'; buff[idx+1] = c; mode = squotes; return std::string_view(buff,idx+2);
-                    case '\n':buff[idx] = '/'; mode=newline; return std::string_view(buff,idx+1);
-                    default: buff[idx] = '/'; buff[idx+1] = c; mode = text; return std::string_view(buff,idx+2);
-                }
-            case Mode::newline:
-                switch (c) {
-                    case EOF: return {};
-                    case ' ':
-                    case '\t':
-                    case '\n':
-                    case '\r': return {};
-                    case '/': mode = begslash; return {};
-                    case '"': mode = quotes; buff[0] = '\n';buff[1] = c; return std::string_view(buff,2);
-                    case '\'': mode = squotes; buff[0] = '\n';buff[1] = c; return std::string_view(buff,2);
-                    default: mode = text;buff[0] = '\n'; buff[1] = c; return std::string_view(buff,2);
-                }
-            default:
-            case Mode::text:
-                switch (c) {
-                    case EOF: buff[0] = ';'; buff[1] = '\n'; return std::string_view(buff,2);
-                    case '/': mode = slash;  return {};
-                    case '\n': 
-                    case '\r': mode = newline; return {};
-                    case '"': last = c; mode = quotes; return std::string_view(&last,1);
-                    case '\'': last = c; mode = squotes; return std::string_view(&last,1);
-                    default: last = c;  return std::string_view(&last,1);
-                }        
+            case Mode::begslash: out.append("\n/\n"); break;
+            case Mode::slash: out.append("/\n"); break;
+            case Mode::text: out.append(";\n"); break;
+            default: break;
         }
     }
 };
 
+struct JSMinifyFilter {
 
-template<typename Filter>
-static bool append_file(std::ostream &out, std::string fname, Filter &&flt) {
-        std::ifstream f(fname);
-        if (!f) {
+    std::string buffer;
+
+    void operator()(std::string_view in, std::string &) {
+        buffer.append(in);
+    }
+    void finish(std::string &out) {
+        js_minify(buffer, out);
+        out.push_back('\n');
+    }
+};
+
+PageBuilder::PageVersion PageBuilder::calc_page_version(BuildMode mode) const {
+    //sorted, so the result doesn't depend on order of the map
+    std::vector<std::pair<std::string, FileStamp> > inputs;
+    inputs.reserve(_stamps.size());
+    for (const auto &[p, st]: _stamps) inputs.emplace_back(p.string(), st);
+    std::sort(inputs.begin(), inputs.end(), [](const auto &a, const auto &b){return a.first < b.first;});
+    std::ostringstream state;
+    state << static_cast<int>(mode) << "\t" << _minify << "\t" << _fingerprint << "\t" << _page->size() << "\n";
+    PageVersion ver;
+    for (const auto &[p, st]: inputs) {
+        state << p << "\t" << st.mtime << "\t" << st.size << "\n";
+        ver.last_modified = std::max<std::time_t>(ver.last_modified, st.mtime / 1000000000);
+    }
+    ver.etag = to_hex(fnv1a(state.str()), 16);
+    return ver;
+}
+
+void PageBuilder::filter_content(BuildCache::Filter filter, std::string_view in, std::string &out) {
+    out.reserve(out.size()+in.size()+3);
+    switch (filter) {
+        case BuildCache::Filter::css: {
+            CSSFilter flt;
+            flt(in, out);
+            flt.finish(out);
+        } break;
+        case BuildCache::Filter::js: {
+            JSFilter flt;
+            flt(in, out);
+            flt.finish(out);
+        } break;
+        case BuildCache::Filter::js_minify: {
+            JSMinifyFilter flt;
+            flt(in, out);
+            flt.finish(out);
+        } break;
+    }
+}
+
+static bool filter_file(BuildCache &cache, const std::filesystem::path &fname, BuildCache::Filter filter, std::string &buffer) {
+        static constexpr std::string_view names[] = {"css", "js", "js-minify"};
+        BuildProfiler::Span _("filter", fname.native());
+        auto data = cache.content(fname);
+        if (!data) {
             return false;
         }
-        int c = f.get();
-        while (c != EOF) {
-            out << flt(c);
-            c = f.get();
+        auto start = BuildProfiler::Clock::now();
+        PageBuilder::filter_content(filter, *data, buffer);
+        BuildProfiler::filter(names[static_cast<int>(filter)], data->size(), buffer.size(), start);
+        return true;
+}
+
+static bool append_file(BuildCache &cache, std::ostream &out, const std::filesystem::path &fname) {
+        auto data = cache.content(fname);
+        if (!data) {
+            return false;
         }
-        out << flt(c);
+        out.write(data->data(), data->size());
         return true;
 }
 
+BuildCache::Content PageBuilder::get_filtered_script(const std::filesystem::path &file) {
+    if (_minify) {
+        return _cache->filtered(file, BuildCache::Filter::js_minify, [&](std::string &out){
+            return filter_file(*_cache, file, BuildCache::Filter::js_minify, out);
+        });
+    } else {
+        return _cache->filtered(file, BuildCache::Filter::js, [&](std::string &out){
+            return filter_file(*_cache, file, BuildCache::Filter::js, out);
+        });
+    }
+}
+
+BuildCache::Content PageBuilder::get_filtered_style(const std::filesystem::path &file) {
+    return _cache->filtered(file, BuildCache::Filter::css, [&](std::string &out){
+        return filter_file(*_cache, file, BuildCache::Filter::css, out);
+    });
+}
 
-void PageBuilder::build_page(const std::filesystem::path &target_html, BuildMode mode)
-{
 
-    std::filesystem::create_directories(target_html.parent_path());
-    std::ofstream out(target_html, std::ios::out|std::ios::trunc);
+static void write_js_string(std::ostream &out, std::string_view str) {
+    out << '"';
+    for (char c: str) {
+        switch (c) {
+            case '"':
+            case '\\': out << '\\' << c; break;
+            //prevents </script> in the page
+            case '<': out << "\\x3C"; break;
+            default: out << c; break;
+        }
+    }
+    out << '"';
+}
+
+void PageBuilder::build_page(std::ostream &out, BuildMode mode)
+{
 
     std::vector<std::filesystem::path> styles_inline;
     std::vector<std::filesystem::path> scripts_inline;
@@ -320,29 +1091,48 @@ void PageBuilder::build_page(const std::filesystem::path &target_html, BuildMode
     if (mode == BuildMode::onefile) {
         styles_inline = sort_sources(&PageBuilder::_styles);
         scripts_inline = sort_sources(&PageBuilder::_scripts);
+        auto is_chunked = [&](const std::filesystem::path &p) {return _chunked.count(p) != 0;};
+        styles_inline.erase(std::remove_if(styles_inline.begin(), styles_inline.end(), is_chunked), styles_inline.end());
+        scripts_inline.erase(std::remove_if(scripts_inline.begin(), scripts_inline.end(), is_chunked), scripts_inline.end());
     } else {
         styles_link = sort_targets(&PageBuilder::_styles);
         scripts_link = sort_targets(&PageBuilder::_scripts);
     }
 
+    //inlined files are filtered in parallel, then they are stitched in the original order
+    std::vector<BuildCache::Content> styles_data(styles_inline.size());
+    std::vector<BuildCache::Content> scripts_data(scripts_inline.size());
+    parallel_for(styles_inline.size() + scripts_inline.size(), [&](std::size_t i) {
+        if (i < styles_inline.size()) {
+            styles_data[i] = get_filtered_style(styles_inline[i]);
+        } else {
+            i -= styles_inline.size();
+            scripts_data[i] = get_filtered_script(scripts_inline[i]);
+        }
+    });
+
     out << "<!DOCTYPE html>"
            "<HTML><HEAD>";
     for (const auto &h: header) {
-        if (!append_file(out, h, EmptyFilter())) {
+        if (!append_file(*_cache, out, h)) {
             _warning(h,0,"Failed to open file");
             continue;;
         }
     }
+    for (const auto &c: _style_chunks) {
+        out << "<LINK rel=\"stylesheet\" href=\"" << c.name << "\">";
+    }
     for (const auto &h: styles_link) {
         out << "<LINK rel=\"stylesheet\" href=\"" << h << "\">";
     }
     if (!styles_inline.empty()) {
         out << "<STYLE>\n";
-        for (const auto &h: styles_inline) {
-            if (!append_file(out, h, CSSFilter())) {
-                _warning(h,0,"Failed to open file");
+        for (std::size_t i = 0; i < styles_inline.size(); ++i) {
+            if (!styles_data[i]) {
+                _warning(styles_inline[i],0,"Failed to open file");
                 continue;;
             }
+            out << *styles_data[i];
         }
         out << "\n</STYLE>";
     }
@@ -356,7 +1146,7 @@ void PageBuilder::build_page(const std::filesystem::path &target_html, BuildMode
         if (n != _page_templates.end()) {
             bool ok;
             out << "<TEMPLATE data-name=\"" << n->second.first << "\">";
-            ok = append_file(out, h, EmptyFilter());
+            ok = append_file(*_cache, out, h);
             out << "</TEMPLATE>";
             if (!ok) {
                 _warning(h,0,"Failed to open file");
@@ -366,7 +1156,7 @@ void PageBuilder::build_page(const std::filesystem::path &target_html, BuildMode
         }
     }
     for (const auto &h: page) {
-        if (!append_file(out, h, EmptyFilter())) {
+        if (!append_file(*_cache, out, h)) {
             _warning(h,0,"Failed to open file");
             continue;;
         }
@@ -384,16 +1174,56 @@ function loadTemplate(name) {
 )javascript";
     }
 
-    for (const auto &h: scripts_inline) {
-        if (!append_file(out, h, JSFilter())) {
+    if (_fingerprint && !_resources.empty()) {
+        out << R"javascript(
+function resourceUrl(name) {
+    return resourceUrl.map[name] || name;
+};
+resourceUrl.map = {)javascript";
+        auto res = sort_sources(&PageBuilder::_resources);
+        for (std::size_t i = 0; i < res.size(); ++i) {
+            const auto &name = _resources.find(res[i])->second.first;
+            if (i) out << ",";
+            out << "\n    ";
+            write_js_string(out, name);
+            out << ":";
+            write_js_string(out, target_name(res[i], name));
+        }
+        out << "\n};\n";
+    }
+
+    if (mode == BuildMode::onefile && !_script_chunks.empty()) {
+        //chunks are loaded before the inlined scripts
+        out << "\n</SCRIPT>";
+        for (const auto &c: _script_chunks) {
+            out << "<SCRIPT type=\"text/javascript\" src=\"" << c.name << "\"></SCRIPT>";
+        }
+        out << "<SCRIPT type=\"text/javascript\">\n";
+        out << "\"use strict\";\n";
+    }
+
+    for (std::size_t i = 0; i < scripts_inline.size(); ++i) {
+        const auto &h = scripts_inline[i];
+        const auto &f = scripts_data[i];
+        if (!f) {
             _warning(h,0,"Failed to open file");
             continue;
         }
+        if (_minify && _minify_report) {
+            auto st = _stamps.find(h);
+            _minify_report(h, st == _stamps.end()?0:st->second.size, f->size());
+        }
+        out << *f;
         out << ";\n";
     }
 
     out << "\n</SCRIPT>";
 
+    if (mode != BuildMode::onefile) {
+        for (const auto &c: _script_chunks) {
+            out << "<SCRIPT type=\"text/javascript\" src=\"" << c.name << "\"></SCRIPT>";
+        }
+    }
 
     for (const auto &h: scripts_link) {
         out << "<SCRIPT type=\"text/javascript\" src=\"" << h << "\"></SCRIPT>";
@@ -403,7 +1233,7 @@ function loadTemplate(name) {
 
 }
 
-std::vector<std::filesystem::path> PageBuilder::sort_sources(OpenedResources PageBuilder::*container)
+std::vector<std::filesystem::path> PageBuilder::sort_sources(OpenedResources PageBuilder::*container) const
 {
     std::vector<std::filesystem::path> out;
     out.reserve((this->*container).size());
@@ -418,7 +1248,9 @@ std::vector<std::string> PageBuilder::sort_targets(OpenedResources PageBuilder::
 {
     std::vector<std::pair<std::string,int > > temp;
     temp.reserve((this->*container).size());
-    for (const auto &[s,t]: (this->*container)) temp.push_back(t);
+    for (const auto &[s,t]: (this->*container)) {
+        if (!_chunked.count(s)) temp.emplace_back(target_name(s, t.first), t.second);
+    }
     std::sort(temp.begin(), temp.end(), [](const auto &a, const auto &b){return a.second < b.second;});
     std::vector<std::string> out;
     out.reserve(temp.size());
@@ -426,32 +1258,230 @@ std::vector<std::string> PageBuilder::sort_targets(OpenedResources PageBuilder::
     return out;
 }
 
-void PageBuilder::link_container_files(OpenedResources PageBuilder::*container, std::filesystem::path target, BuildMode mode)
+std::string PageBuilder::content_hash(std::string_view data) {
+    //folded to 32 bits
+    return to_hex(fnv1a(data), 8);
+}
+
+static std::string fingerprinted_name(const std::string &name, std::string_view hash) {
+    auto slash = name.rfind('/');
+    auto dot = name.rfind('.');
+    if (dot == name.npos || (slash != name.npos && dot < slash) || dot == (slash == name.npos?0:slash+1)) dot = name.size();
+    std::string out(name, 0, dot);
+    out.push_back('.');
+    out.append(hash);
+    out.append(name, dot);
+    return out;
+}
+
+bool PageBuilder::is_fingerprinted(std::string_view name) {
+    auto slash = name.rfind('/');
+    if (slash != name.npos) name = name.substr(slash+1);
+    auto dot = name.find('.', 1);
+    while (dot != name.npos) {
+        auto next = name.find('.', dot+1);
+        auto seg = name.substr(dot+1, next == name.npos?name.npos:next-dot-1);
+        if (seg.size() == 8 && seg.find_first_not_of("0123456789abcdef") == seg.npos) return true;
+        dot = next;
+    }
+    return false;
+}
+
+std::string PageBuilder::target_name(const std::filesystem::path &src, const std::string &name) const {
+    if (!_fingerprint) return name;
+    auto iter = _hashes.find(src);
+    if (iter == _hashes.end()) return name;
+    return fingerprinted_name(name, iter->second);
+}
+
+bool PageBuilder::update_hashes(const std::filesystem::path &target, BuildMode mode, std::vector<std::filesystem::path> &outdated) {
+    auto remove_outdated = [&](const std::string &name, std::string_view hash) {
+        auto old = target / fingerprinted_name(name, hash);
+        outdated.push_back(old);
+        old += ".gz";
+        outdated.push_back(std::move(old));
+    };
+    Hashes hashes;
+    for (auto container: {&PageBuilder::_styles, &PageBuilder::_scripts, &PageBuilder::_resources}) {
+        for (const auto &[src, trg]: this->*container) {
+            auto iter = _hashes.find(src);
+            //inlined files don't need names
+            if (!_fingerprint || _chunked.count(src)
+                    || (mode == BuildMode::onefile && container != &PageBuilder::_resources)) {
+                if (iter != _hashes.end()) remove_outdated(trg.first, iter->second);
+                continue;
+            }
+            if (iter != _hashes.end() && !is_changed(src)) {
+                hashes.insert(*iter);
+                continue;
+            }
+            //sources are taken from the cache, resources are read directly, they are not kept in memory
+            BuildCache::Content data;
+            if (container == &PageBuilder::_resources) {
+                std::string buff;
+                if (read_file(src, buff)) data = std::make_shared<const std::string>(std::move(buff));
+            } else {
+                data = _cache->content(src);
+            }
+            //missing file is reported later
+            if (!data) continue;
+            BuildProfiler::Span _("hash", src.native());
+            auto h = content_hash(*data);
+            if (iter != _hashes.end() && iter->second != h) remove_outdated(trg.first, iter->second);
+            hashes.emplace(src, std::move(h));
+        }
+    }
+    bool changed = hashes != _hashes;
+    _hashes = std::move(hashes);
+    return changed;
+}
+
+
+void PageBuilder::plan_links(OpenedResources PageBuilder::*container, const std::filesystem::path &target, BuildMode mode, bool force, bool compress, std::vector<LinkTask> &tasks)
 {
     for (const auto &[src, trg]: (this->*container)){
-        auto fulltrg = target / trg.first;
-        auto parent = fulltrg.parent_path();
-        std::filesystem::create_directories(parent);   
-        if (src != fulltrg) {
-            std::error_code ec;     
-            std::filesystem::remove(fulltrg, ec);
-            switch (mode)         {
-                default:
-                case BuildMode::copy:
-                    std::filesystem::copy_file(src,fulltrg,ec);break;
-                    break;
-                case BuildMode::hardlink:
-                    std::filesystem::create_hard_link(src,fulltrg,ec);break;
-                    break;
-                case BuildMode::symlink:
-                    std::filesystem::create_symlink(src,fulltrg,ec);break;
-                    break;
+        if (_chunked.count(src)) continue;
+        auto fulltrg = target / target_name(src, trg.first);
+        bool relink = true;
+        if (!force) {
+            std::error_code ec;
+            bool exists = std::filesystem::exists(std::filesystem::symlink_status(fulltrg, ec));
+            bool changed = is_changed(src);
+            //symlink follows the changes of the source, no need to relink
+            relink = !exists || (mode != BuildMode::symlink && changed);
+            auto gzname = fulltrg;
+            gzname += ".gz";
+            bool recompress = compress && (changed || !std::filesystem::exists(gzname, ec));
+            if (!relink && !recompress) continue;
+        }
+        if (src == fulltrg) {
+            _warning(fulltrg, 0, "skipped, points to the same file");
+            continue;
+        }
+        tasks.push_back({src, std::move(fulltrg), relink, compress, {}});
+    }
+}
+
+void PageBuilder::run_link(LinkTask &task, BuildMode mode) const
+{
+    const auto &src = task.src;
+    const auto &fulltrg = task.target;
+    BuildProfiler::Span _("link", fulltrg.native());
+    if (task.relink) {
+        //the link is created under temporary name, then it replaces the target atomically
+        auto tmp = temp_file(fulltrg);
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        switch (mode)         {
+            default:
+            case BuildMode::copy:
+                std::filesystem::copy_file(src,tmp,ec);
+                if (!ec && BuildProfiler::enabled()) {
+                    std::error_code ec2;
+                    BuildProfiler::count(BuildProfiler::Counter::file_written);
+                    BuildProfiler::count(BuildProfiler::Counter::bytes_written, std::filesystem::file_size(tmp, ec2));
+                }
+                break;
+            case BuildMode::hardlink:
+                std::filesystem::create_hard_link(src,tmp,ec);
+                break;
+            case BuildMode::symlink:
+                std::filesystem::create_symlink(src,tmp,ec);
+                break;
+        }
+        if (!ec) std::filesystem::rename(tmp, fulltrg, ec);
+        if (ec) {
+            task.warnings.emplace_back(fulltrg,"Failed to link: "+ec.message());
+        }
+        //rename does nothing when both names are links of the same file
+        std::error_code ec2;
+        std::filesystem::remove(tmp, ec2);
+    }
+    //compressed file is created after the link, so it is never older than the target
+    auto gzname = fulltrg;
+    gzname += ".gz";
+    if (task.compress) {
+        //only scripts and styles are compressed, so they are in the cache
+        auto data = _cache->content(src);
+        if (!data) task.warnings.emplace_back(src, "Failed to open file");
+        else if (!write_compressed(gzname, *data)) task.warnings.emplace_back(gzname, "Failed to write compressed file");
+    } else if (task.relink) {
+        std::error_code ec;
+        std::filesystem::remove(gzname, ec);
+    }
+}
+
+///write the file only when its content differs, so it doesn't trigger following builds
+static bool write_if_changed(const std::filesystem::path &fname, std::string_view data) {
+    std::string cur;
+    if (read_file(fname, cur) && cur == data) return true;
+    return PageBuilder::write_file(fname, data);
+}
+
+bool PageBuilder::write_embedded(const std::filesystem::path &target_html) {
+    auto parent = target_html.parent_path();
+    std::vector<EmbeddedFile> files;
+    //the page is added first, so a linked file can't take its path
+    std::unordered_set<std::string> paths;
+    auto add = [&](const std::string &name, BuildCache::Content data) {
+        std::string path("/");
+        path.append(name);
+        if (!paths.insert(path).second) {
+            _warning(name, 0, "skipped, path is already used by other embedded file");
+            return;
+        }
+        auto tag = content_hash(*data);
+        files.push_back({std::move(path), std::string(content_type_of(name)), std::move(tag), std::move(data), nullptr});
+    };
+    add(target_html.filename().string(), _page);
+    //content of chunks is prepared by the owner
+    for (const auto *lst: {&_style_chunks, &_script_chunks}) {
+        for (const auto &c: *lst) {
+            if (!c.content) {
+                _warning(parent / c.name, 0, "Missing content of the chunk");
+                continue;
             }
-            if (ec) {            
-                _warning(fulltrg,0,"Failed to link: "+ec.message());
+            add(c.name, c.content);
+        }
+    }
+    for (auto container: {&PageBuilder::_styles, &PageBuilder::_scripts, &PageBuilder::_resources}) {
+        for (const auto &src: sort_sources(container)) {
+            if (_chunked.count(src)) continue;
+            BuildCache::Content data;
+            //resources are read directly, they are not kept in memory
+            if (container == &PageBuilder::_resources) {
+                std::string buff;
+                if (read_file(src, buff)) data = std::make_shared<const std::string>(std::move(buff));
+            } else {
+                data = _cache->content(src);
             }
-        } else {
-            _warning(fulltrg, 0, "skipped, points to the same file");
+            if (!data) {
+                _warning(src, 0, "Failed to open file");
+                continue;
+            }
+            add(target_name(src, (this->*container).find(src)->second.first), std::move(data));
         }
     }
+    if (_compress) {
+        parallel_for(files.size(), [&](std::size_t i) {
+            auto &f = files[i];
+            //small files are not worth to compress
+            if (!is_compressible(f.content_type) || f.data->size() <= 256) return;
+            BuildProfiler::Span _("compress", f.path);
+            auto gz = gzip_compress(*f.data);
+            if (gz.size() < f.data->size()) f.gzip = std::make_shared<const std::string>(std::move(gz));
+        });
+    }
+    auto header = embed_header_path(target_html);
+    auto source = embed_source_path(target_html);
+    auto gen = generate_embedded(embed_namespace(target_html.filename().string()), header.filename().string(), files);
+    if (!write_if_changed(header, gen.header)) {
+        _warning(header, 0, "Failed to write embedded source");
+        return false;
+    }
+    if (!write_if_changed(source, gen.source)) {
+        _warning(source, 0, "Failed to write embedded source");
+        return false;
+    }
+    return true;
 }
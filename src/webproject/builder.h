@@ -3,11 +3,17 @@
 #define _builder_src_builder_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
 
 #include <filesystem>
+#include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <mutex>
+#include <array>
+#include <cstdint>
+#include <ctime>
 
 
 enum class BuildMode {
@@ -15,8 +21,12 @@ enum class BuildMode {
     hardlink,
     copy,
     onefile,
+    ///page and linked files are embedded to generated C++ sources
+    embed,
 };
 
+class BuildCache;
+
 struct SearchPaths {
 
     using List =  std::vector<std::filesystem::path>;
@@ -34,8 +44,118 @@ struct SearchPaths {
     /// resources
     List resources;
 
-    std::filesystem::path find(List SearchPaths::*where, std::string_view name) const;
+    ///find file in the list of folders
+    /**
+     * @param where list of folders
+     * @param name name of the file (can contain relative path)
+     * @param cache cache which holds index of the folders
+     * @return path to the file, empty if not found
+     */
+    std::filesystem::path find(List SearchPaths::*where, std::string_view name, BuildCache &cache) const;
+
+    bool operator==(const SearchPaths &) const = default;
+};
+
+///Identifies state of a file (or directory) - changes when file is modified
+struct FileStamp {
+    std::int64_t mtime = 0;
+    std::uintmax_t size = 0;
+
+    bool operator==(const FileStamp &) const = default;
+
+    ///retrieve stamp of given file, returns empty stamp if file doesn't exist
+    static FileStamp get(const std::filesystem::path &p);
+};
+
+///Cache of parsed and filtered sources, can be shared by builders of multiple pages
+/**
+ * Entries are validated by stamp of the source file, so they are reused until the
+ * file is modified. The object is thread safe
+ */
+class BuildCache {
+public:
+
+    ///Directive found in a script
+    struct Directive {
+        std::string cmd;
+        std::string param;
+        int line;
+    };
+
+    using Directives = std::vector<Directive>;
+    using Content = std::shared_ptr<const std::string>;
+
+    ///Kind of filter applied to the content
+    enum class Filter {
+        css,
+        js,
+        js_minify
+    };
+
+    ///Retrieve content of the source file
+    /**
+     * The file is read once by single read, following calls return the same buffer until
+     * the file is modified. Intended for sources (scripts, styles, fragments), not for large resources
+     *
+     * @param file source file
+     * @return content of the file, nullptr if the file can't be read
+     */
+    Content content(const std::filesystem::path &file);
+
+    ///Retrieve directives of the script
+    /**
+     * @param file script
+     * @param parse function which parses the script, called when the entry is missing or outdated
+     * @return directives
+     */
+    std::shared_ptr<const Directives> directives(const std::filesystem::path &file, const std::function<Directives()> &parse);
 
+    ///Retrieve filtered content of the file
+    /**
+     * @param file source file
+     * @param filter filter
+     * @param make function which reads and filters the file, called when the entry is missing or outdated.
+     * The function returns false, if the file can't be read
+     * @return filtered content, nullptr if the file can't be read
+     */
+    Content filtered(const std::filesystem::path &file, Filter filter, const std::function<bool(std::string &)> &make);
+
+    ///Determines whether the file exists and it is a regular file (or a link to it)
+    /**
+     * The directory of the file is read once and kept in an index, so the function
+     * doesn't access the filesystem for already indexed directories. Use refresh_index() to detect
+     * changes
+     *
+     * @param file path to the file
+     * @retval true file exists
+     * @retval false file doesn't exist
+     */
+    bool is_regular_file(const std::filesystem::path &file);
+
+    ///Validate indexed directories by their stamps, changed directories are read again
+    /**
+     * @return version of the index. It changes whenever any indexed directory has been
+     * changed, so results of lookups made with different version can be outdated
+     */
+    std::uint64_t refresh_index();
+
+protected:
+
+    template<typename T>
+    struct Entry {
+        FileStamp stamp;
+        T value;
+    };
+
+    std::mutex _lock;
+    std::unordered_map<std::filesystem::path, Entry<Content> > _sources;
+    std::unordered_map<std::filesystem::path, Entry<std::shared_ptr<const Directives> > > _directives;
+    std::unordered_map<std::filesystem::path, Entry<Content> > _filtered[3];
+    ///index of directories - names of regular files
+    std::unordered_map<std::filesystem::path, Entry<std::unordered_set<std::string> > > _dirs;
+    std::uint64_t _dirs_version = 0;
+
+    static Entry<std::unordered_set<std::string> > read_dir(const std::filesystem::path &dir);
 };
 
 struct PageResources {
@@ -48,10 +168,27 @@ class PageBuilder {
 public:
     using OpenedResources = std::unordered_map<std::filesystem::path, std::pair<std::string, int> >;
     using BlockedNames = std::unordered_set<std::string>;
+    using Stamps = std::unordered_map<std::filesystem::path, FileStamp>;
+    using Hashes = std::unordered_map<std::filesystem::path, std::string>;
 
     using WaringOut = std::function<void(std::string, int, std::string)>;
+    ///receives file name, size before and size after minification
+    using MinifyReport = std::function<void(const std::filesystem::path &, std::size_t, std::size_t)>;
 
-    PageBuilder(WaringOut wout):_warning(std::move(wout)) {}
+    PageBuilder(WaringOut wout):_warning(std::move(wout)),_cache(std::make_shared<BuildCache>()) {}
+
+    ///Shared chunk - files moved from the page to a separate file shared by multiple pages
+    struct Chunk {
+        ///name of the chunk file, relative to the page
+        std::string name;
+        ///sources included in the chunk
+        std::vector<std::filesystem::path> files;
+        ///content of the chunk, set when the chunk is not written to a file (embed and server mode)
+        BuildCache::Content content;
+
+        bool operator==(const Chunk &) const = default;
+    };
+    using Chunks = std::vector<Chunk>;
 
 
 
@@ -60,10 +197,210 @@ public:
 
     void prepare(const std::filesystem::path & src_file, const SearchPaths &paths);
 
-    void build(const std::filesystem::path &target_html, BuildMode mode);
+    ///Build the page and link resources
+    /**
+     * @param target_html target page. Linked resources are placed relative to its directory
+     * @param mode build mode
+     * @param write_page write the page to the target_html. If false, the page is only
+     * built in memory and available through get_page()
+     *
+     * In embed mode, nothing is linked. The page, linked scripts, styles, resources and
+     * shared chunks are written to C++ sources next to the target (index.h and index.cpp for
+     * index.html). The sources are rewritten only when their content changes
+     */
+    void build(const std::filesystem::path &target_html, BuildMode mode, bool write_page = true);
 
+    ///Render the page to a stream
+    void build_page(std::ostream &out, BuildMode mode);
+
+    ///Retrieve content of the page built by last build()
+    /**
+     * @return content of the page. The buffer is never modified, the next build
+     * creates a new one, so it is safe to keep the pointer while the page is rebuilt
+     */
+    std::shared_ptr<const std::string> get_page() const {return _page;}
+
+    ///Identifies version of the built page
+    struct PageVersion {
+        ///hash of the build inputs (names and stamps of all sources, build options)
+        std::string etag;
+        ///latest modification time of the sources
+        std::time_t last_modified = 0;
+    };
+
+    ///Retrieve version of the page built by last build()
+    /**
+     * The version is derived from the state of inputs, so it doesn't change, until
+     * any input is changed. It can be used for conditional requests
+     */
+    const PageVersion &get_page_version() const {return _page_version;}
+
+    ///load dependency graph stored by previous build of the target page
+    /**
+     * The graph is stored next to the target page by the function build(). Once
+     * loaded, following prepare() and build() can skip the unchanged work
+     *
+     * @param target_html target page
+     * @retval true state loaded
+     * @retval false state is not available or it is not valid
+     */
+    bool load_state(const std::filesystem::path &target_html);
+
+    ///Enable minification of scripts inlined to the page
+    /**
+     * Scripts are processed by javascript tokenizer (see js_minify()) instead of
+     * the simple filter, which removes only comments and indentation. It is applied
+     * only in onefile mode, linked scripts are never modified
+     *
+     * @param enable true to enable minification
+     * @param report optional function called for every minified file
+     */
+    void set_minify(bool enable, MinifyReport report = nullptr) {
+        _minify = enable;
+        _minify_report = std::move(report);
+    }
+
+    ///Enable creation of precompressed files
+    /**
+     * When enabled, the page, linked scripts and linked styles get a gzip
+     * compressed sibling (with extension .gz), which can be served directly
+     * to clients accepting gzip encoding
+     *
+     * @param enable true to enable
+     */
+    void set_compress(bool enable) {_compress = enable;}
+
+    ///Enable content hash in names of linked files
+    /**
+     * Names of linked scripts, styles and resources contain hash of their content
+     * (for example dialog.3f9a1c02.js), so they can be cached by the browser forever.
+     * Because resources are referenced by the scripts, the page contains function
+     * resourceUrl(name), which translates original name to the fingerprinted name
+     *
+     * @param enable true to enable
+     */
+    void set_fingerprint(bool enable) {_fingerprint = enable;}
+
+    ///Determines whether the name of the file contains content hash
+    /**
+     * @param name name of file or url path
+     * @retval true name is fingerprinted, content of the file never changes
+     * @retval false name is not fingerprinted
+     */
+    static bool is_fingerprinted(std::string_view name);
+
+    ///Calculate hash of the content, which is used to fingerprint names
+    static std::string content_hash(std::string_view data);
+
+    ///Write file atomically
+    /**
+     * The content is written to a temporary file in the same directory, which then
+     * replaces the target by rename(). Readers (for example the server) see either
+     * the previous or the new content, never a partially written file
+     *
+     * @param fname name of the file
+     * @param data content
+     * @retval true written
+     * @retval false failed to write, the target is not changed
+     */
+    static bool write_file(const std::filesystem::path &fname, std::string_view data);
+
+    ///Retrieve unique name of temporary file used to replace the file atomically
+    /**
+     * The name contains process id and a counter, so each call returns different name
+     */
+    static std::filesystem::path temp_file(const std::filesystem::path &fname);
+
+    ///Parse directives (//#command param) of the script
+    /**
+     * @param script content of the script
+     * @return directives in order of appearance
+     */
+    static BuildCache::Directives parse_directives(std::string_view script);
+
+    ///Retrieve search paths used to resolve the directive
+    /**
+     * @param directive command of the directive (require, style, ...)
+     * @return member of SearchPaths, nullptr if the directive is unknown
+     */
+    static SearchPaths::List SearchPaths::*search_paths_of(std::string_view directive);
+
+    ///Filter content as it is inlined to the page
+    /**
+     * @param filter filter to apply
+     * @param in source content
+     * @param out filtered content is appended here
+     */
+    static void filter_content(BuildCache::Filter filter, std::string_view in, std::string &out);
+
+    ///Share cache with other builders
+    void set_cache(std::shared_ptr<BuildCache> cache) {_cache = std::move(cache);}
+
+    ///Set shared chunks
+    /**
+     * Files included in a chunk are not inlined nor linked. The page links the chunk
+     * instead. Chunks are linked before other files in given order. Content of the chunks
+     * is not written by the builder
+     *
+     * @param scripts chunks of scripts
+     * @param styles chunks of styles
+     */
+    void set_chunks(Chunks scripts, Chunks styles);
+
+    ///Retrieve names of all chunks used by last build
+    const std::vector<std::string> &get_built_chunks() const {return _built_chunks;}
+
+    ///Retrieve scripts of current graph in order of inclusion
+    std::vector<std::filesystem::path> get_scripts() const {return sort_sources(&PageBuilder::_scripts);}
+    ///Retrieve styles of current graph in order of inclusion
+    std::vector<std::filesystem::path> get_styles() const {return sort_sources(&PageBuilder::_styles);}
+
+    ///Retrieve filtered content of a script (as it is inlined to the page)
+    BuildCache::Content get_filtered_script(const std::filesystem::path &file);
+    ///Retrieve filtered content of a style (as it is inlined to the page)
+    BuildCache::Content get_filtered_style(const std::filesystem::path &file);
+
+    ///retrieve all source files of the current graph
+    std::vector<std::filesystem::path> get_inputs() const;
+
+    ///retrieve all search paths and all directories searched for the sources of the current graph
+    std::vector<std::filesystem::path> get_search_dirs() const;
+
+    ///File published by the build (besides the page)
+    struct BuiltAsset {
+        ///the file in the directory of the page
+        std::filesystem::path file;
+        ///compressed copy (.gz) has been written
+        bool compressed;
+        ///the file has been written by the build (false when the page refers the source directly)
+        bool generated;
+        ///content of a chunk, which is not written to the file (see Chunk::content)
+        BuildCache::Content data = {};
+    };
+
+    ///retrieve manifest of files published by last build()
+    /**
+     * Lists linked files (in onefile mode only resources) and shared chunks, these
+     * are files referred by the page. The page itself and compressed copies are not included
+     */
+    std::vector<BuiltAsset> get_assets() const;
+
+    ///retrieve all files generated by last build()
+    /**
+     * Includes the page, linked files, shared chunks and compressed copies. Content of
+     * the chunks is written by the owner of the chunks, but they are listed here too
+     */
+    std::vector<std::filesystem::path> get_outputs() const;
+
+    ///retrieve files which represent the page built by last build()
+    /**
+     * @return the page, or generated sources in embed mode
+     */
+    std::vector<std::filesystem::path> get_page_outputs() const;
+
+    ///retrieves path of file, where the state is stored for given target page
+    static std::filesystem::path state_file(const std::filesystem::path &target_html);
 
-    
 
 protected:
     WaringOut _warning;
@@ -76,11 +413,93 @@ protected:
     BlockedNames _processed;
     BlockedNames _allocated;
     int index = 0;
+    ///resolved directives (section, context directory and name), reused by following prepare()
+    std::unordered_map<std::string, std::filesystem::path> _resolved;
+    ///version of the directory index when _resolved was filled
+    std::uint64_t _resolved_version = 0;
+
+    ///source file of current graph
+    std::filesystem::path _source;
+    ///search paths of current graph
+    SearchPaths _search;
+    ///stamps of files and directories which were used to create current graph
+    Stamps _graph;
+    ///stamps of all sources during last build
+    Stamps _built;
+    ///stamps of all sources during current build
+    Stamps _stamps;
+    ///target of last build
+    std::filesystem::path _built_target;
+    ///build mode of last build
+    BuildMode _built_mode = BuildMode::onefile;
+    ///minify inlined scripts
+    bool _minify = false;
+    MinifyReport _minify_report;
+    ///minification setting of last build
+    bool _built_minify = false;
+    ///create .gz siblings
+    bool _compress = false;
+    ///compress setting of last build
+    bool _built_compress = false;
+    ///put content hash to names of linked files
+    bool _fingerprint = false;
+    ///fingerprint setting of last build
+    bool _built_fingerprint = false;
+    ///content hashes of linked files (when fingerprint is enabled)
+    Hashes _hashes;
+    ///cache of parsed and filtered sources
+    std::shared_ptr<BuildCache> _cache;
+    ///shared chunks of scripts
+    Chunks _script_chunks;
+    ///shared chunks of styles
+    Chunks _style_chunks;
+    ///files moved to the chunks
+    std::unordered_set<std::filesystem::path> _chunked;
+    ///names of chunks used by last build
+    std::vector<std::string> _built_chunks;
+    ///graph has been changed since last build
+    bool _graph_changed = true;
+    ///the page on the disk matches the last build
+    bool _page_written = false;
+    ///content of the page built by last build
+    std::shared_ptr<const std::string> _page;
+    ///version of the page built by last build
+    PageVersion _page_version;
+
+    struct Section {
+        std::string_view directive;
+        SearchPaths::List SearchPaths::*paths;
+        OpenedResources PageBuilder::*resource;
+    };
 
-    std::vector<std::filesystem::path> sort_sources(OpenedResources PageBuilder::*container);
+    static const std::array<Section, 6> _sections;
+
+    ///index of the section of the directive, _sections.size() if the directive is unknown
+    static std::size_t find_section(std::string_view directive);
+
+    std::vector<std::filesystem::path> sort_sources(OpenedResources PageBuilder::*container) const;
+    std::vector<std::string> chunk_names() const;
     std::vector<std::string> sort_targets(OpenedResources PageBuilder::*container);
-    void link_container_files(OpenedResources PageBuilder::*container, std::filesystem::path target, BuildMode mode);
-    void build_page(const std::filesystem::path &target, BuildMode mode);
+    ///file to be linked to the target directory
+    struct LinkTask {
+        std::filesystem::path src;
+        std::filesystem::path target;
+        bool relink;
+        bool compress;
+        ///warnings reported by the task (file, message)
+        std::vector<std::pair<std::string, std::string> > warnings;
+    };
+
+    void plan_links(OpenedResources PageBuilder::*container, const std::filesystem::path &target, BuildMode mode, bool force, bool compress, std::vector<LinkTask> &tasks);
+    void run_link(LinkTask &task, BuildMode mode) const;
+    bool write_embedded(const std::filesystem::path &target_html);
+    bool update_hashes(const std::filesystem::path &target, BuildMode mode, std::vector<std::filesystem::path> &outdated);
+    std::string target_name(const std::filesystem::path &src, const std::string &name) const;
+    PageVersion calc_page_version(BuildMode mode) const;
+    bool graph_changed() const;
+    bool is_changed(const std::filesystem::path &src) const;
+    bool is_changed(OpenedResources PageBuilder::*container) const;
+    void save_state(const std::filesystem::path &target_html);
 };
 
 
@@ -0,0 +1,129 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+std::string gzip_compress(std::string_view data) {
+    z_stream strm = {};
+    //15 bits window + 16 = gzip header
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("gzip_compress: deflateInit failed");
+    }
+    std::string out;
+    out.resize(deflateBound(&strm, data.size()));
+    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    strm.avail_in = static_cast<uInt>(data.size());
+    strm.next_out = reinterpret_cast<Bytef *>(out.data());
+    strm.avail_out = static_cast<uInt>(out.size());
+    int r = deflate(&strm, Z_FINISH);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    if (r != Z_STREAM_END) {
+        throw std::runtime_error("gzip_compress: deflate failed");
+    }
+    return out;
+}
+
+bool is_compressible(std::string_view content_type) {
+    return content_type.compare(0, 5, "text/") == 0
+            || content_type.find("javascript") != content_type.npos
+            || content_type.find("json") != content_type.npos
+            || content_type.find("xml") != content_type.npos;
+}
+
+namespace {
+
+struct ContentType {
+    std::string_view ext;
+    std::string_view type;
+};
+
+}
+
+///content types by extension, sorted by extension
+static constexpr ContentType content_types[] = {
+    {".css", "text/css;charset=utf-8"},
+    {".gif", "image/gif"},
+    {".htm", "text/html;charset=utf-8"},
+    {".html", "text/html;charset=utf-8"},
+    {".ico", "image/x-icon"},
+    {".jpeg", "image/jpeg"},
+    {".jpg", "image/jpeg"},
+    {".js", "text/javascript;charset=utf-8"},
+    {".json", "application/json"},
+    {".map", "application/json"},
+    {".mjs", "text/javascript;charset=utf-8"},
+    {".png", "image/png"},
+    {".svg", "image/svg+xml"},
+    {".txt", "text/plain;charset=utf-8"},
+    {".wasm", "application/wasm"},
+    {".webp", "image/webp"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+};
+
+static_assert(std::is_sorted(std::begin(content_types), std::end(content_types), [](const ContentType &a, const ContentType &b){
+    return a.ext < b.ext;
+}));
+
+std::string_view content_type_of(std::string_view name) {
+    auto slash = name.rfind('/');
+    if (slash != name.npos) name = name.substr(slash+1);
+    auto dot = name.rfind('.');
+    if (dot == name.npos) return "application/octet-stream";
+    auto ext = name.substr(dot);
+    auto iter = std::lower_bound(std::begin(content_types), std::end(content_types), ext, [](const ContentType &a, std::string_view b){
+        return a.ext < b;
+    });
+    if (iter == std::end(content_types) || iter->ext != ext) return "application/octet-stream";
+    return iter->type;
+}
+
+std::shared_ptr<const std::string> GzipCache::get(const std::string &name, int fd) {
+    struct stat st;
+    if (::fstat(fd, &st) || !S_ISREG(st.st_mode)) return nullptr;
+    std::int64_t mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    {
+        std::lock_guard _(_lock);
+        auto iter = _entries.find(name);
+        if (iter != _entries.end()) {
+            if (iter->second.mtime == mtime && iter->second.size == st.st_size) {
+                _lru.splice(_lru.begin(), _lru, iter->second.lru);
+                return iter->second.data;
+            }
+            erase(iter);
+        }
+    }
+    //compress outside of the lock, other files can be served meanwhile
+    std::string content;
+    content.resize(st.st_size);
+    std::size_t pos = 0;
+    while (pos < content.size()) {
+        auto r = ::pread(fd, content.data()+pos, content.size()-pos, pos);
+        if (r <= 0) return nullptr;
+        pos += r;
+    }
+    auto data = std::make_shared<const std::string>(gzip_compress(content));
+    if (data->size() > _max_bytes) return data;
+
+    std::lock_guard _(_lock);
+    auto iter = _entries.find(name);
+    if (iter != _entries.end()) erase(iter);
+    _lru.push_front(name);
+    _entries.emplace(name, Entry{mtime, st.st_size, data, _lru.begin()});
+    _bytes += data->size();
+    while (_bytes > _max_bytes) {
+        erase(_entries.find(_lru.back()));
+    }
+    return data;
+}
+
+void GzipCache::erase(std::unordered_map<std::string, Entry>::iterator iter) {
+    _bytes -= iter->second.data->size();
+    _lru.erase(iter->second.lru);
+    _entries.erase(iter);
+}
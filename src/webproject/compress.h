@@ -0,0 +1,79 @@
+#pragma once
+#ifndef _builder_src_compress_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_compress_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+///Compress data to gzip format
+/**
+ * @param data data to compress
+ * @return compressed data
+ * @exception std::runtime_error compression failed
+ */
+std::string gzip_compress(std::string_view data);
+
+///Determines whether content of given type is worth to compress
+/**
+ * @param content_type content type
+ * @retval true text content (html, css, javascript, svg, json, etc)
+ * @retval false other content, it is probably already compressed
+ */
+bool is_compressible(std::string_view content_type);
+
+///Determine content type by extension of the file
+/**
+ * @param name name of the file or url path
+ * @return content type, application/octet-stream for unknown extension
+ */
+std::string_view content_type_of(std::string_view name);
+
+///Cache of files compressed on the fly
+/**
+ * Files are identified by name, the cached content is invalidated when the file's
+ * mtime or size changes. When total size of the cache exceeds the limit, the least
+ * recently used entries are removed
+ */
+class GzipCache {
+public:
+
+    ///Construct cache
+    /**
+     * @param max_bytes maximum total size of compressed data held by cache
+     */
+    explicit GzipCache(std::size_t max_bytes = 16*1024*1024):_max_bytes(max_bytes) {}
+
+    ///Retrieve compressed content of the file
+    /**
+     * @param name name of the file (key)
+     * @param fd opened file. The descriptor is not closed
+     * @return compressed content, or nullptr if the file can't be read
+     */
+    std::shared_ptr<const std::string> get(const std::string &name, int fd);
+
+protected:
+
+    struct Entry {
+        std::int64_t mtime;
+        std::int64_t size;
+        std::shared_ptr<const std::string> data;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::size_t _max_bytes;
+    std::size_t _bytes = 0;
+    std::mutex _lock;
+    std::unordered_map<std::string, Entry> _entries;
+    ///names, the most recently used is first
+    std::list<std::string> _lru;
+
+    void erase(std::unordered_map<std::string, Entry>::iterator iter);
+};
+
+
+#endif
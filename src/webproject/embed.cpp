@@ -0,0 +1,269 @@
+#include "embed.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+//the hash is compiled here and emitted to the generated source, both must be the same
+static constexpr std::string_view hash_source = R"cpp(
+constexpr std::uint32_t hash(std::string_view s, std::uint32_t seed) {
+    std::uint32_t h = 2166136261U ^ seed;
+    for (char c: s) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+)cpp";
+
+static constexpr std::uint32_t hash(std::string_view s, std::uint32_t seed) {
+    std::uint32_t h = 2166136261U ^ seed;
+    for (char c: s) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+namespace {
+
+///Perfect hash table (hash and displace)
+/**
+ * Keys are distributed to buckets by hash(key, 0). Every bucket has a seed, which
+ * places all its keys to free slots by hash(key, seed). Large buckets are placed first
+ */
+struct PerfectHash {
+    std::vector<std::uint32_t> seeds;
+    std::vector<std::uint32_t> slots;
+
+    ///keys must be unique
+    explicit PerfectHash(const std::vector<std::string_view> &keys) {
+        std::size_t count = keys.size();
+        //distinct keys fit in few attempts, the limit only prevents endless loop
+        std::size_t max_size = 4 * count + 16;
+        for (std::size_t size = std::max<std::size_t>(1, count); size <= max_size; ++size) {
+            if (build(keys, size)) return;
+        }
+        throw std::runtime_error("generate_embedded: failed to build hash table");
+    }
+
+    bool build(const std::vector<std::string_view> &keys, std::size_t size) {
+        static constexpr std::uint32_t max_seed = 1U << 20;
+        std::vector<std::vector<std::uint32_t> > buckets(size);
+        for (std::uint32_t i = 0; i < keys.size(); ++i) {
+            buckets[hash(keys[i], 0) % size].push_back(i);
+        }
+        std::vector<std::size_t> order(size);
+        for (std::size_t i = 0; i < size; ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){
+            return buckets[a].size() > buckets[b].size();
+        });
+        seeds.assign(size, 0);
+        std::vector<bool> used(size, false);
+        slots.assign(size, 0);
+        std::vector<std::size_t> pos;
+        for (auto b: order) {
+            const auto &bucket = buckets[b];
+            if (bucket.empty()) break;
+            std::uint32_t seed = 1;
+            for (; seed < max_seed; ++seed) {
+                pos.clear();
+                bool ok = true;
+                for (auto k: bucket) {
+                    std::size_t p = hash(keys[k], seed) % size;
+                    if (used[p] || std::find(pos.begin(), pos.end(), p) != pos.end()) {
+                        ok = false;
+                        break;
+                    }
+                    pos.push_back(p);
+                }
+                if (ok) break;
+            }
+            if (seed == max_seed) return false;
+            seeds[b] = seed;
+            for (std::size_t i = 0; i < bucket.size(); ++i) {
+                used[pos[i]] = true;
+                slots[pos[i]] = bucket[i];
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+static void append_string(std::string &out, std::string_view str) {
+    out.push_back('"');
+    for (char c: str) {
+        auto u = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (u < 32 || u >= 127) {
+            //octal escape has limited length, so it doesn't consume following digits
+            out.push_back('\\');
+            out.push_back(static_cast<char>('0' + (u >> 6)));
+            out.push_back(static_cast<char>('0' + ((u >> 3) & 7)));
+            out.push_back(static_cast<char>('0' + (u & 7)));
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+}
+
+static void append_array(std::string &out, std::string_view name, std::string_view data) {
+    out.append("constexpr unsigned char ").append(name).append("[] = {");
+    std::size_t line = 0;
+    for (char c: data) {
+        if (line == 0) out.append("\n    ");
+        auto v = std::to_string(static_cast<unsigned char>(c));
+        out.append(v).push_back(',');
+        line += v.size() + 1;
+        if (line >= 96) line = 0;
+    }
+    out.append("\n};\n");
+}
+
+static void append_table(std::string &out, std::string_view name, const std::vector<std::uint32_t> &table) {
+    out.append("constexpr std::uint32_t ").append(name).append("[] = {");
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (i % 16 == 0) out.append("\n    ");
+        out.append(std::to_string(table[i])).push_back(',');
+    }
+    out.append("\n};\n");
+}
+
+EmbeddedSources generate_embedded(std::string_view ns, std::string_view header_name, const std::vector<EmbeddedFile> &files) {
+    if (files.empty()) throw std::invalid_argument("generate_embedded: no files");
+    EmbeddedSources out;
+    out.header.append("//generated by webproject, do not edit\n"
+                      "#pragma once\n\n"
+                      "#include <cstddef>\n"
+                      "#include <string_view>\n\n"
+                      "namespace ").append(ns).append(" {\n\n");
+    out.header.append(R"cpp(///Embedded file
+struct File {
+    ///url path
+    std::string_view path;
+    ///content type
+    std::string_view content_type;
+    ///entity tag of the content (quoted)
+    std::string_view etag;
+    ///entity tag of the compressed content (quoted), empty if not compressed
+    std::string_view gzip_etag;
+    const unsigned char *content;
+    std::size_t content_size;
+    const unsigned char *gzip_content;
+    std::size_t gzip_size;
+
+    ///content of the file
+    std::string_view data() const {return {reinterpret_cast<const char *>(content), content_size};}
+    ///gzip compressed content of the file, empty if not compressed
+    std::string_view gzip() const {return {reinterpret_cast<const char *>(gzip_content), gzip_size};}
+};
+
+///all embedded files, the page is first
+extern const File files[];
+///count of embedded files
+extern const std::size_t file_count;
+
+///Find file by url path (without query)
+/**
+ * @param path url path, "/" is the page
+ * @return pointer to the file, nullptr if not found
+ */
+const File *find(std::string_view path);
+
+}
+)cpp");
+
+    std::vector<std::string_view> keys;
+    for (const auto &f: files) keys.push_back(f.path);
+    {
+        auto sorted = keys;
+        std::sort(sorted.begin(), sorted.end());
+        auto dup = std::adjacent_find(sorted.begin(), sorted.end());
+        if (dup != sorted.end()) {
+            throw std::invalid_argument(std::string("generate_embedded: duplicate path: ").append(*dup));
+        }
+    }
+    PerfectHash ph(keys);
+
+    auto &src = out.source;
+    src.append("//generated by webproject, do not edit\n"
+               "#include \"").append(header_name).append("\"\n\n"
+               "#include <cstdint>\n\n"
+               "namespace ").append(ns).append(" {\n\n"
+               "namespace {\n\n");
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const auto &f = files[i];
+        if (!f.data->empty()) append_array(src, "data_" + std::to_string(i), *f.data);
+        if (f.gzip && !f.gzip->empty()) append_array(src, "gzip_" + std::to_string(i), *f.gzip);
+    }
+    src.append(hash_source);
+    append_table(src, "seeds", ph.seeds);
+    append_table(src, "slots", ph.slots);
+    src.append("\n}\n\nconst File files[] = {\n");
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const auto &f = files[i];
+        std::string idx = std::to_string(i);
+        src.append("    {");
+        append_string(src, f.path);
+        src.append(", ");
+        append_string(src, f.content_type);
+        src.append(", ");
+        append_string(src, "\"" + f.etag + "\"");
+        src.append(", ");
+        bool gz = f.gzip && !f.gzip->empty();
+        append_string(src, gz?"\"" + f.etag + "-gz\"":std::string());
+        src.append(", ");
+        if (f.data->empty()) src.append("nullptr, 0, ");
+        else src.append("data_").append(idx).append(", ").append(std::to_string(f.data->size())).append(", ");
+        if (gz) src.append("gzip_").append(idx).append(", ").append(std::to_string(f.gzip->size()));
+        else src.append("nullptr, 0");
+        src.append("},\n");
+    }
+    src.append("};\n\n"
+               "const std::size_t file_count = ").append(std::to_string(files.size())).append(";\n\n");
+    src.append("const File *find(std::string_view path) {\n"
+               "    if (path == \"/\") return files;\n"
+               "    auto seed = seeds[hash(path, 0) % ").append(std::to_string(ph.seeds.size())).append("];\n"
+               "    const File &f = files[slots[hash(path, seed) % ").append(std::to_string(ph.slots.size())).append("]];\n"
+               "    return f.path == path?&f:nullptr;\n"
+               "}\n\n"
+               "}\n");
+    return out;
+}
+
+std::string embed_namespace(std::string_view page_name) {
+    std::string out;
+    for (char c: page_name) {
+        bool alnum = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        out.push_back(alnum?c:'_');
+    }
+    if (out.empty() || (out[0] >= '0' && out[0] <= '9')) out.insert(out.begin(), '_');
+    return out;
+}
+
+std::filesystem::path embed_header_path(const std::filesystem::path &target_html) {
+    auto p = target_html;
+    p.replace_extension(".h");
+    return p;
+}
+
+std::filesystem::path embed_source_path(const std::filesystem::path &target_html) {
+    auto p = target_html;
+    p.replace_extension(".cpp");
+    return p;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#ifndef _builder_src_embed_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_embed_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+///File embedded to the generated C++ sources
+struct EmbeddedFile {
+    ///url path, begins with '/'
+    std::string path;
+    ///content type
+    std::string content_type;
+    ///entity tag, without quotes
+    std::string etag;
+    ///content
+    std::shared_ptr<const std::string> data;
+    ///gzip compressed content, nullptr if not available
+    std::shared_ptr<const std::string> gzip;
+};
+
+///Generated C++ sources
+struct EmbeddedSources {
+    ///content of the header
+    std::string header;
+    ///content of the source
+    std::string source;
+};
+
+///Generate C++ sources which contain the files
+/**
+ * Content of the files is stored in constexpr arrays. The source contains
+ * perfect hash table, which maps url path to the file, so the lookup needs
+ * one comparison of the path. The tables are constant initialized, they are
+ * ready before any dynamic initialization
+ *
+ * Generated API (in the namespace):
+ * @code
+ * struct File {
+ *     std::string_view path, content_type, etag, gzip_etag;
+ *     std::string_view data() const;
+ *     std::string_view gzip() const;      //empty, when not compressed
+ * };
+ * extern const File files[];           //all files, the page is first
+ * extern const std::size_t file_count;
+ * const File *find(std::string_view path);  //"/" is the page, nullptr if not found
+ * @endcode
+ *
+ * @param ns namespace of the generated code
+ * @param header_name name of the header, included by the source
+ * @param files files to embed, the first file is the page. Paths must be unique
+ * @return generated sources
+ * @exception std::invalid_argument no files or duplicate path
+ */
+EmbeddedSources generate_embedded(std::string_view ns, std::string_view header_name, const std::vector<EmbeddedFile> &files);
+
+///Derive name of the namespace from name of the page
+/**
+ * @param page_name name of the page (for example index.html)
+ * @return valid C++ identifier (for example index_html)
+ */
+std::string embed_namespace(std::string_view page_name);
+
+///Path of the generated header for given target page
+std::filesystem::path embed_header_path(const std::filesystem::path &target_html);
+///Path of the generated source for given target page
+std::filesystem::path embed_source_path(const std::filesystem::path &target_html);
+
+
+#endif
@@ -0,0 +1,324 @@
+#include "jsminify.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+enum class Token {
+    none,
+    word,
+    number,
+    string,
+    templ,
+    regex,
+    punct
+};
+
+enum class Brace {
+    block,
+    expr,
+    templ
+};
+
+///punctuators longer than one character, longest first
+constexpr std::string_view punctuators[] = {
+    ">>>=",
+    "...", "===", "!==", "**=", "<<=", ">>=", ">>>", "&&=", "||=", "?\?=",
+    "=>", "==", "!=", "<=", ">=", "&&", "||", "??", "?.", "++", "--", "+=", "-=",
+    "*=", "/=", "%=", "&=", "|=", "^=", "<<", ">>", "**"
+};
+
+///keywords after which an expression follows (so '/' starts a regular expression)
+constexpr std::string_view expr_keywords[] = {
+    "return", "typeof", "instanceof", "in", "of", "new", "delete", "void",
+    "throw", "case", "do", "else", "yield", "await"
+};
+
+///keywords followed by a condition in parentheses, which is followed by a statement
+constexpr std::string_view cond_keywords[] = {
+    "if", "while", "for", "with"
+};
+
+bool is_word_char(char c) {
+    auto u = static_cast<unsigned char>(c);
+    return (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') || (u >= '0' && u <= '9')
+            || c == '_' || c == '$' || c == '\\' || u >= 0x80;
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+bool is_expr_keyword(std::string_view w) {
+    return std::find(std::begin(expr_keywords), std::end(expr_keywords), w) != std::end(expr_keywords);
+}
+
+bool is_cond_keyword(std::string_view w) {
+    return std::find(std::begin(cond_keywords), std::end(cond_keywords), w) != std::end(cond_keywords);
+}
+
+class Minifier {
+public:
+    Minifier(std::string_view src, std::string &out):src(src),out(out) {}
+
+    void run();
+
+protected:
+    std::string_view src;
+    std::string &out;
+    std::size_t pos = 0;
+    std::vector<Brace> braces;
+    Token prev = Token::none;
+    std::string_view prev_text;
+    ///kind of last closed brace (valid when prev_text is "}")
+    Brace closed = Brace::block;
+    ///open parentheses, true when the parenthesis encloses condition of if, while, for, with
+    std::vector<bool> parens;
+    ///last closed parenthesis enclosed a condition (valid when prev_text is ")")
+    bool closed_cond = false;
+
+    bool regex_allowed() const;
+    Brace open_brace() const;
+    bool needs_space(char a, char b, Token next) const;
+    bool line_break_matters(char a, char b) const;
+    void emit(Token kind, std::size_t begin, bool space, bool newline);
+    std::size_t scan_string(std::size_t p, char q) const;
+    std::size_t scan_template(std::size_t p);
+    std::size_t scan_regex(std::size_t p) const;
+    std::size_t scan_number(std::size_t p) const;
+    std::size_t scan_word(std::size_t p) const;
+    std::size_t scan_punct(std::size_t p) const;
+};
+
+bool Minifier::regex_allowed() const {
+    switch (prev) {
+        case Token::none: return true;
+        case Token::word: return is_expr_keyword(prev_text);
+        case Token::templ: return prev_text.size() >= 2 && prev_text.substr(prev_text.size()-2) == "${";
+        case Token::punct:
+            //if (x) /re/.test(s) - statement follows the condition
+            if (prev_text == ")") return closed_cond;
+            if (prev_text == "]" || prev_text == "++" || prev_text == "--") return false;
+            if (prev_text == "}") return closed != Brace::expr;
+            return true;
+        default: return false;
+    }
+}
+
+Brace Minifier::open_brace() const {
+    switch (prev) {
+        case Token::word: return is_expr_keyword(prev_text) && prev_text != "do" && prev_text != "else"?Brace::expr:Brace::block;
+        case Token::templ: return regex_allowed()?Brace::expr:Brace::block;
+        case Token::punct:
+            if (prev_text == ")" || prev_text == ";" || prev_text == "}" || prev_text == "{" || prev_text == "=>") return Brace::block;
+            return Brace::expr;
+        default: return Brace::block;
+    }
+}
+
+bool Minifier::needs_space(char a, char b, Token next) const {
+    //tokens would merge (words, numbers, regex flags)
+    if (is_word_char(a) && is_word_char(b)) return true;
+    if (prev == Token::regex && is_word_char(b)) return true;
+    //a + +b, a - -b
+    if ((a == '+' || a == '-') && b == a) return true;
+    //a / /re/ would become comment
+    if (a == '/' && (b == '/' || b == '*')) return true;
+    //1 .toString()
+    if (prev == Token::number && b == '.') return true;
+    //don't create <!-- and -->
+    if ((a == '<' && b == '!') || (a == '-' && b == '>')) return true;
+    return next == Token::number && a == '.';
+}
+
+bool Minifier::line_break_matters(char a, char b) const {
+    //automatic semicolon insertion can apply between these tokens
+    bool ends = is_word_char(a) || prev == Token::regex
+            || a == ')' || a == ']' || a == '}' || a == '"' || a == '\'' || a == '`'
+            || a == '+' || a == '-';
+    bool starts = is_word_char(b)
+            || b == '(' || b == '[' || b == '{' || b == '+' || b == '-' || b == '!' || b == '~'
+            || b == '"' || b == '\'' || b == '`' || b == '/' || b == '#' || b == '@';
+    return ends && starts;
+}
+
+void Minifier::emit(Token kind, std::size_t begin, bool space, bool newline) {
+    std::string_view text = src.substr(begin, pos - begin);
+    if (text.empty()) return;
+    if (prev != Token::none && (space || newline)) {
+        char a = prev_text.back();
+        char b = text.front();
+        if (newline && line_break_matters(a, b)) out.push_back('\n');
+        else if (needs_space(a, b, kind)) out.push_back(' ');
+    }
+    out.append(text);
+    prev = kind;
+    prev_text = text;
+}
+
+std::size_t Minifier::scan_string(std::size_t p, char q) const {
+    while (p < src.size()) {
+        char c = src[p];
+        if (c == '\\') p += 2;
+        else if (c == q) return p + 1;
+        else if (c == '\n') return p;   //unterminated string
+        else ++p;
+    }
+    return src.size();
+}
+
+std::size_t Minifier::scan_template(std::size_t p) {
+    while (p < src.size()) {
+        char c = src[p];
+        if (c == '\\') {
+            p += 2;
+        } else if (c == '`') {
+            return p + 1;
+        } else if (c == '$' && p + 1 < src.size() && src[p+1] == '{') {
+            braces.push_back(Brace::templ);
+            return p + 2;
+        } else {
+            ++p;
+        }
+    }
+    return src.size();
+}
+
+std::size_t Minifier::scan_regex(std::size_t p) const {
+    bool cls = false;
+    while (p < src.size()) {
+        char c = src[p];
+        if (c == '\\') {
+            p += 2;
+        } else if (c == '\n') {
+            return p;                   //unterminated regex
+        } else if (cls) {
+            if (c == ']') cls = false;
+            ++p;
+        } else if (c == '[') {
+            cls = true;
+            ++p;
+        } else if (c == '/') {
+            ++p;
+            while (p < src.size() && is_word_char(src[p])) ++p;
+            return p;
+        } else {
+            ++p;
+        }
+    }
+    return src.size();
+}
+
+std::size_t Minifier::scan_number(std::size_t p) const {
+    bool prefixed = src[p] == '0' && p + 1 < src.size()
+            && std::string_view("xXbBoO").find(src[p+1]) != std::string_view::npos;
+    ++p;
+    while (p < src.size()) {
+        char c = src[p];
+        if (is_word_char(c) || c == '.') ++p;
+        else if ((c == '+' || c == '-') && !prefixed && (src[p-1] == 'e' || src[p-1] == 'E')) ++p;
+        else break;
+    }
+    return p;
+}
+
+std::size_t Minifier::scan_word(std::size_t p) const {
+    while (p < src.size() && is_word_char(src[p])) ++p;
+    return p;
+}
+
+std::size_t Minifier::scan_punct(std::size_t p) const {
+    for (auto x: punctuators) {
+        if (src.compare(p, x.size(), x) == 0) return p + x.size();
+    }
+    return p + 1;
+}
+
+void Minifier::run() {
+    for(;;) {
+        bool space = false;
+        bool newline = false;
+        while (pos < src.size()) {
+            char c = src[pos];
+            if (c == '\n' || c == '\r') {
+                newline = true;
+                ++pos;
+            } else if (is_space(c)) {
+                space = true;
+                ++pos;
+            } else if ((c == '/' && src.compare(pos, 2, "//") == 0)
+                    || (c == '<' && src.compare(pos, 4, "<!--") == 0)
+                    || (c == '-' && (newline || prev == Token::none) && src.compare(pos, 3, "-->") == 0)) {
+                //line comment, including html-like comments
+                pos = std::min(src.find('\n', pos), src.size());
+            } else if (c == '/' && src.compare(pos, 2, "/*") == 0) {
+                auto e = src.find("*/", pos + 2);
+                auto stop = e == src.npos?src.size():e + 2;
+                if (src.substr(pos, stop - pos).find_first_of("\r\n") != src.npos) newline = true;
+                else space = true;
+                pos = stop;
+            } else {
+                break;
+            }
+        }
+        if (pos >= src.size()) break;
+
+        std::size_t begin = pos;
+        char c = src[pos];
+        Token kind;
+        if (c == '"' || c == '\'') {
+            pos = scan_string(pos + 1, c);
+            kind = Token::string;
+        } else if (c == '`') {
+            pos = scan_template(pos + 1);
+            kind = Token::templ;
+        } else if (is_digit(c) || (c == '.' && pos + 1 < src.size() && is_digit(src[pos+1]))) {
+            pos = scan_number(pos);
+            kind = Token::number;
+        } else if (is_word_char(c)) {
+            pos = scan_word(pos);
+            kind = Token::word;
+        } else if (c == '/' && regex_allowed()) {
+            pos = scan_regex(pos + 1);
+            kind = Token::regex;
+        } else if (c == '}' && !braces.empty() && braces.back() == Brace::templ) {
+            //continuation of template literal after ${ }
+            braces.pop_back();
+            pos = scan_template(pos + 1);
+            kind = Token::templ;
+        } else {
+            pos = scan_punct(pos);
+            kind = Token::punct;
+            if (c == '(') {
+                parens.push_back(prev == Token::word && is_cond_keyword(prev_text));
+            } else if (c == ')') {
+                closed_cond = false;
+                if (!parens.empty()) {
+                    closed_cond = parens.back();
+                    parens.pop_back();
+                }
+            } else if (c == '{') {
+                braces.push_back(open_brace());
+            } else if (c == '}') {
+                closed = Brace::block;
+                if (!braces.empty()) {
+                    closed = braces.back();
+                    braces.pop_back();
+                }
+            }
+        }
+        emit(kind, begin, space, newline);
+    }
+}
+
+}
+
+void js_minify(std::string_view src, std::string &out) {
+    Minifier m(src, out);
+    m.run();
+}
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef _builder_src_jsminify_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_jsminify_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <string>
+#include <string_view>
+
+///Minify javascript
+/**
+ * Source is split to tokens (identifiers, numbers, strings, template literals including
+ * nested ${} expressions, regular expressions and punctuators). Comments are removed and
+ * whitespace between tokens is collapsed. A space is kept only where tokens would
+ * merge, a line break is kept where automatic semicolon insertion can depend on it.
+ * Content of the tokens is never changed
+ *
+ * @param src source script
+ * @param out minified script is appended here
+ */
+void js_minify(std::string_view src, std::string &out);
+
+
+#endif
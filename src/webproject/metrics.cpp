@@ -0,0 +1,86 @@
+#include "metrics.h"
+
+#include <cstdio>
+
+///format number for OpenMetrics
+static void append_number(std::string &out, double v) {
+    char buff[32];
+    auto n = std::snprintf(buff, sizeof(buff), "%.9g", v);
+    out.append(buff, n);
+}
+
+void MetricHistogram::observe(std::chrono::steady_clock::duration d) {
+    double secs = std::chrono::duration<double>(d).count();
+    std::size_t i = 0;
+    while (i < bounds.size() && secs > bounds[i]) ++i;
+    _buckets[i].fetch_add(1, std::memory_order_relaxed);
+    _sum_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), std::memory_order_relaxed);
+}
+
+void MetricHistogram::render(std::string &out, std::string_view name) const {
+    out.append("# TYPE ").append(name).append(" histogram\n");
+    out.append("# UNIT ").append(name).append(" seconds\n");
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < _buckets.size(); ++i) {
+        total += _buckets[i].load(std::memory_order_relaxed);
+        out.append(name).append("_bucket{le=\"");
+        if (i < bounds.size()) append_number(out, bounds[i]);
+        else out.append("+Inf");
+        out.append("\"} ").append(std::to_string(total)).append("\n");
+    }
+    out.append(name).append("_sum ");
+    append_number(out, static_cast<double>(_sum_ns.load(std::memory_order_relaxed)) / 1e9);
+    out.append("\n");
+    out.append(name).append("_count ").append(std::to_string(total)).append("\n");
+}
+
+static std::size_t type_index(std::string_view content_type) {
+    if (content_type.empty()) return 7;
+    auto sep = content_type.find(';');
+    auto t = content_type.substr(0, sep);
+    if (t == "text/html") return 0;
+    if (t.find("javascript") != t.npos) return 1;
+    if (t == "text/css") return 2;
+    if (t.compare(0, 6, "image/") == 0) return 3;
+    if (t.compare(0, 5, "font/") == 0) return 4;
+    if (t.compare(0, 5, "text/") == 0) return 5;
+    return 6;
+}
+
+void ServerMetrics::response(int code, std::string_view content_type) {
+    std::size_t c = 0;
+    while (c < codes.size()-1 && codes[c] != code) ++c;
+    _requests[c][type_index(content_type)].add();
+}
+
+std::string ServerMetrics::render() const {
+    std::string out;
+    out.append("# TYPE webproject_http_requests counter\n"
+               "# HELP webproject_http_requests Responses sent by the server\n");
+    for (std::size_t c = 0; c < codes.size(); ++c) {
+        for (std::size_t t = 0; t < types.size(); ++t) {
+            auto v = _requests[c][t].get();
+            if (!v) continue;
+            out.append("webproject_http_requests_total{code=\"");
+            if (codes[c]) out.append(std::to_string(codes[c]));
+            else out.append("other");
+            out.append("\",type=\"").append(types[t]).append("\"} ").append(std::to_string(v)).append("\n");
+        }
+    }
+    out.append("# TYPE webproject_http_sent_bytes counter\n"
+               "# HELP webproject_http_sent_bytes Bytes sent to clients\n"
+               "webproject_http_sent_bytes_total ").append(std::to_string(_bytes_sent.get())).append("\n");
+    out.append("# TYPE webproject_http_connections counter\n"
+               "# HELP webproject_http_connections Accepted connections\n"
+               "webproject_http_connections_total ").append(std::to_string(_connections.get())).append("\n");
+    out.append("# TYPE webproject_http_open_connections gauge\n"
+               "# HELP webproject_http_open_connections Currently opened connections\n"
+               "webproject_http_open_connections ").append(std::to_string(_open_connections.get())).append("\n");
+    _request_duration.render(out, "webproject_http_request_duration_seconds");
+    out.append("# TYPE webproject_rebuilds counter\n"
+               "# HELP webproject_rebuilds Rebuilds of the pages\n"
+               "webproject_rebuilds_total ").append(std::to_string(_rebuilds.get())).append("\n");
+    _rebuild_duration.render(out, "webproject_rebuild_duration_seconds");
+    out.append("# EOF\n");
+    return out;
+}
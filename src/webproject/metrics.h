@@ -0,0 +1,98 @@
+#pragma once
+#ifndef _builder_src_metrics_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_metrics_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+///Monotonic counter
+class MetricCounter {
+public:
+    void add(std::uint64_t v = 1) {_value.fetch_add(v, std::memory_order_relaxed);}
+    std::uint64_t get() const {return _value.load(std::memory_order_relaxed);}
+protected:
+    std::atomic<std::uint64_t> _value = 0;
+};
+
+///Value which can go up and down
+class MetricGauge {
+public:
+    void add(std::int64_t v) {_value.fetch_add(v, std::memory_order_relaxed);}
+    std::int64_t get() const {return _value.load(std::memory_order_relaxed);}
+protected:
+    std::atomic<std::int64_t> _value = 0;
+};
+
+///Histogram of durations with fixed buckets (from 0.5ms to 10s)
+class MetricHistogram {
+public:
+    ///upper bounds of the buckets in seconds, the last bucket (+Inf) is implicit
+    static constexpr std::array<double, 14> bounds = {
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+
+    void observe(std::chrono::steady_clock::duration d);
+
+    ///render the histogram in OpenMetrics format
+    /**
+     * @param out output buffer
+     * @param name name of the metric family
+     */
+    void render(std::string &out, std::string_view name) const;
+
+protected:
+    std::array<std::atomic<std::uint64_t>, bounds.size()+1> _buckets = {};
+    std::atomic<std::uint64_t> _sum_ns = 0;
+};
+
+///Metrics of the server and the builder
+/**
+ * All metrics are updated by atomic operations without locking, so they can be
+ * updated by multiple threads and rendered at any time. Labels have fixed set of values
+ */
+class ServerMetrics {
+public:
+
+    ///status codes tracked by label, other codes are reported as "other"
+    static constexpr std::array<int, 10> codes = {200, 204, 206, 304, 400, 404, 405, 416, 500, 0};
+    ///types of content (derived from content type)
+    static constexpr std::array<std::string_view, 8> types = {
+        "html", "script", "style", "image", "font", "text", "other", "none"
+    };
+
+    ///Record response
+    /**
+     * @param code status code
+     * @param content_type content type of the response (empty if there is no content)
+     */
+    void response(int code, std::string_view content_type);
+    ///Record duration of processing of the request
+    void request_duration(std::chrono::steady_clock::duration d) {_request_duration.observe(d);}
+    ///Record bytes sent to the network
+    void sent(std::uint64_t bytes) {_bytes_sent.add(bytes);}
+    ///Record accepted connection
+    void connection_opened() {_connections.add(); _open_connections.add(1);}
+    ///Record closed connection
+    void connection_closed() {_open_connections.add(-1);}
+    ///Record rebuild of the pages
+    void rebuild(std::chrono::steady_clock::duration d) {_rebuilds.add(); _rebuild_duration.observe(d);}
+
+    ///Render all metrics in OpenMetrics text format (including final # EOF)
+    std::string render() const;
+
+protected:
+    std::array<std::array<MetricCounter, types.size()>, codes.size()> _requests;
+    MetricCounter _bytes_sent;
+    MetricCounter _connections;
+    MetricGauge _open_connections;
+    MetricHistogram _request_duration;
+    MetricCounter _rebuilds;
+    MetricHistogram _rebuild_duration;
+};
+
+
+#endif
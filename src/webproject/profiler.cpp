@@ -0,0 +1,148 @@
+#include "profiler.h"
+
+#include <fstream>
+#include <iomanip>
+
+std::atomic<bool> BuildProfiler::_enabled = false;
+
+BuildProfiler &BuildProfiler::instance() {
+    static BuildProfiler inst;
+    return inst;
+}
+
+///small sequential id of the current thread, used in the trace
+static unsigned int thread_index() {
+    static std::atomic<unsigned int> next = 0;
+    thread_local unsigned int idx = ++next;
+    return idx;
+}
+
+void BuildProfiler::enable(bool trace) {
+    auto &inst = instance();
+    {
+        std::lock_guard _(inst._lock);
+        inst._trace = trace;
+    }
+    reset();
+    _enabled = true;
+}
+
+void BuildProfiler::reset() {
+    auto &inst = instance();
+    std::lock_guard _(inst._lock);
+    inst._start = Clock::now();
+    for (auto &c: inst._counters) c = 0;
+    inst._totals.clear();
+    inst._phases.clear();
+    inst._filters.clear();
+    inst._events.clear();
+}
+
+void BuildProfiler::record(std::string_view cat, std::string name, Clock::time_point start, Clock::time_point end) {
+    std::lock_guard _(_lock);
+    Total *t;
+    if (cat == "phase") {
+        t = &_phases.try_emplace(name).first->second;
+    } else {
+        t = &_totals.try_emplace(std::string(cat)).first->second;
+    }
+    ++t->count;
+    t->time += end - start;
+    if (_trace) _events.push_back({cat, std::move(name), start, end, thread_index()});
+}
+
+void BuildProfiler::filter(std::string_view filter, std::size_t in, std::size_t out, Clock::time_point start) {
+    if (!enabled()) return;
+    auto dur = Clock::now() - start;
+    auto &inst = instance();
+    std::lock_guard _(inst._lock);
+    auto &f = inst._filters.try_emplace(std::string(filter)).first->second;
+    ++f.files;
+    f.in += in;
+    f.out += out;
+    f.time += dur;
+}
+
+static double to_ms(BuildProfiler::Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void BuildProfiler::print_stats(std::ostream &out) {
+    auto &inst = instance();
+    std::lock_guard _(inst._lock);
+    auto cnt = [&](Counter c) {return inst._counters[static_cast<int>(c)].load();};
+    auto flags = out.flags();
+    auto prec = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "Build statistics (" << to_ms(Clock::now() - inst._start) << " ms)\n";
+    out << " Phases (wall time):\n";
+    for (const auto &[name, t]: inst._phases) {
+        out << "  " << std::left << std::setw(16) << name << std::right << std::setw(12) << to_ms(t.time) << " ms\n";
+    }
+    out << " Work items (count, time summed over threads):\n";
+    for (const auto &[name, t]: inst._totals) {
+        out << "  " << std::left << std::setw(16) << name << std::right << std::setw(8) << t.count
+            << std::setw(12) << to_ms(t.time) << " ms\n";
+    }
+    out << " I/O:\n"
+        << "  read             " << cnt(Counter::file_read) << " files, " << cnt(Counter::bytes_read) << " bytes\n"
+        << "  written          " << cnt(Counter::file_written) << " files, " << cnt(Counter::bytes_written) << " bytes\n"
+        << "  stat             " << cnt(Counter::stat) << " calls\n"
+        << "  directory reads  " << cnt(Counter::dir_read) << "\n";
+    if (!inst._filters.empty()) {
+        out << " Filters:\n";
+        for (const auto &[name, f]: inst._filters) {
+            double secs = std::chrono::duration<double>(f.time).count();
+            out << "  " << std::left << std::setw(16) << name << std::right << std::setw(8) << f.files << " files "
+                << f.in << " -> " << f.out << " bytes, "
+                << std::setprecision(1) << (secs > 0?static_cast<double>(f.in) / secs / 1048576.0:0.0) << " MB/s\n"
+                << std::setprecision(3);
+        }
+    }
+    out.flags(flags);
+    out.precision(prec);
+    out.flush();
+}
+
+static void write_json_string(std::ostream &out, std::string_view s) {
+    out.put('"');
+    for (char c: s) {
+        switch (c) {
+            case '"': out << "\\\"";break;
+            case '\\': out << "\\\\";break;
+            case '\n': out << "\\n";break;
+            case '\t': out << "\\t";break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+                } else {
+                    out.put(c);
+                }
+        }
+    }
+    out.put('"');
+}
+
+bool BuildProfiler::write_trace(const std::filesystem::path &fname) {
+    auto &inst = instance();
+    std::lock_guard _(inst._lock);
+    auto us = [&](Clock::time_point tp) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(tp - inst._start).count();
+    };
+    std::ofstream out(fname, std::ios::out|std::ios::trunc);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto &e: inst._events) {
+        if (!first) out << ",\n";
+        first = false;
+        out << "{\"name\":";
+        write_json_string(out, e.name);
+        out << ",\"cat\":";
+        write_json_string(out, e.cat);
+        out << ",\"ph\":\"X\",\"ts\":" << us(e.start) << ",\"dur\":" << us(e.end) - us(e.start)
+            << ",\"pid\":1,\"tid\":" << e.tid << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    out.close();
+    return !!out;
+}
@@ -0,0 +1,146 @@
+#pragma once
+#ifndef _builder_src_profiler_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_profiler_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+///Collects statistics and trace of the build
+/**
+ * The profiler is global, because the counted operations (stat, read, write) are spread
+ * over static helpers. When it is disabled (default), every probe costs only a check
+ * of an atomic flag. The object is thread safe
+ */
+class BuildProfiler {
+public:
+
+    enum class Counter {
+        ///stat() calls made by the builder
+        stat,
+        ///directories read by the index
+        dir_read,
+        ///files read
+        file_read,
+        ///bytes read
+        bytes_read,
+        ///files written (pages, copies, compressed files, chunks)
+        file_written,
+        ///bytes written
+        bytes_written,
+        _count
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    ///Measures a span of time. The span is recorded when the object is destroyed
+    class Span {
+    public:
+        ///Start the span
+        /**
+         * @param cat category - phase of the build. Category "phase" is used for the
+         * top level phases, which are reported as wall time
+         * @param name name of the span, usually name of the processed file
+         */
+        Span(std::string_view cat, std::string_view name):_cat(cat) {
+            if (enabled()) {
+                _name = name;
+                _start = Clock::now();
+                _active = true;
+            }
+        }
+        ~Span() {
+            if (_active) instance().record(_cat, std::move(_name), _start, Clock::now());
+        }
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+    protected:
+        std::string_view _cat;
+        std::string _name;
+        Clock::time_point _start;
+        bool _active = false;
+    };
+
+    ///Enable the profiler
+    /**
+     * @param trace collect trace events (one per span), otherwise only totals are collected
+     */
+    static void enable(bool trace);
+
+    ///Determines whether the profiler is enabled
+    static bool enabled() {return _enabled.load(std::memory_order_relaxed);}
+
+    ///Increase a counter
+    static void count(Counter c, std::uint64_t v = 1) {
+        if (enabled()) instance()._counters[static_cast<int>(c)].fetch_add(v, std::memory_order_relaxed);
+    }
+
+    ///Record processing of the file by a filter
+    /**
+     * @param filter name of the filter
+     * @param in size of input
+     * @param out size of output
+     * @param start time when the filter started
+     */
+    static void filter(std::string_view filter, std::size_t in, std::size_t out, Clock::time_point start);
+
+    ///Clear collected data, called before the build
+    static void reset();
+
+    ///Print statistics of the build
+    static void print_stats(std::ostream &out);
+
+    ///Write trace in Chrome trace-event format (chrome://tracing, Perfetto)
+    /**
+     * @param fname target file
+     * @retval true written
+     * @retval false failed to write
+     */
+    static bool write_trace(const std::filesystem::path &fname);
+
+protected:
+
+    struct Event {
+        std::string_view cat;
+        std::string name;
+        Clock::time_point start;
+        Clock::time_point end;
+        unsigned int tid;
+    };
+
+    struct Total {
+        std::size_t count = 0;
+        Clock::duration time = {};
+    };
+
+    struct FilterTotal {
+        std::size_t files = 0;
+        std::uint64_t in = 0;
+        std::uint64_t out = 0;
+        Clock::duration time = {};
+    };
+
+    static std::atomic<bool> _enabled;
+    bool _trace = false;
+    Clock::time_point _start;
+    std::atomic<std::uint64_t> _counters[static_cast<int>(Counter::_count)] = {};
+    std::mutex _lock;
+    ///totals of spans by category (phases by name)
+    std::map<std::string, Total, std::less<> > _totals;
+    std::map<std::string, Total, std::less<> > _phases;
+    std::map<std::string, FilterTotal, std::less<> > _filters;
+    std::vector<Event> _events;
+
+    static BuildProfiler &instance();
+    void record(std::string_view cat, std::string name, Clock::time_point start, Clock::time_point end);
+};
+
+
+#endif
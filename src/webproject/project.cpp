@@ -0,0 +1,270 @@
+#include "project.h"
+#include "compress.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+
+void ProjectBuilder::add_page(std::filesystem::path source, std::filesystem::path target) {
+    auto bld = std::make_unique<PageBuilder>(_warning);
+    bld->set_cache(_cache);
+    _pages.push_back({std::move(source), std::move(target), std::move(bld)});
+}
+
+void ProjectBuilder::set_minify(bool enable, PageBuilder::MinifyReport report) {
+    for (auto &p: _pages) p.builder->set_minify(enable, report);
+}
+
+void ProjectBuilder::set_compress(bool enable) {
+    _compress = enable;
+    for (auto &p: _pages) p.builder->set_compress(enable);
+}
+
+void ProjectBuilder::set_fingerprint(bool enable) {
+    for (auto &p: _pages) p.builder->set_fingerprint(enable);
+}
+
+void ProjectBuilder::load_state() {
+    for (auto &p: _pages) p.builder->load_state(p.target);
+}
+
+void ProjectBuilder::prepare(const SearchPaths &paths) {
+    for (auto &p: _pages) p.builder->prepare(p.source, paths);
+}
+
+void ProjectBuilder::build(BuildMode mode, bool write_pages) {
+    std::vector<std::vector<std::string> > old_chunks;
+    for (const auto &p: _pages) old_chunks.push_back(p.builder->get_built_chunks());
+
+    ChunkContent content;
+    std::vector<PageBuilder::Chunks> scripts(_pages.size());
+    std::vector<PageBuilder::Chunks> styles(_pages.size());
+    if (_shared && _pages.size() > 1) {
+        BuildProfiler::Span _("phase", "chunks");
+        std::vector<FileList> script_lists;
+        std::vector<FileList> style_lists;
+        for (const auto &p: _pages) {
+            script_lists.push_back(p.builder->get_scripts());
+            style_lists.push_back(p.builder->get_styles());
+        }
+        scripts = make_chunks(script_lists, true, content);
+        styles = make_chunks(style_lists, false, content);
+    }
+    //in embed and server mode, chunks are passed to the pages in memory
+    bool write_files = write_pages && mode != BuildMode::embed;
+    std::vector<std::vector<std::string> > new_chunks;
+    for (std::size_t i = 0; i < _pages.size(); ++i) {
+        if (!write_files) {
+            for (auto *lst: {&styles[i], &scripts[i]}) {
+                for (auto &c: *lst) c.content = content.at(c.name);
+            }
+        }
+        auto &lst = new_chunks.emplace_back();
+        for (const auto &c: styles[i]) lst.push_back(c.name);
+        for (const auto &c: scripts[i]) lst.push_back(c.name);
+        _pages[i].builder->set_chunks(std::move(scripts[i]), std::move(styles[i]));
+    }
+    //chunks no longer used are removed after the pages are published
+    std::vector<std::filesystem::path> outdated;
+    if (write_files) {
+        BuildProfiler::Span _("phase", "chunks");
+        write_chunks(old_chunks, new_chunks, content, outdated);
+    }
+    for (auto &p: _pages) p.builder->build(p.target, mode, write_pages);
+    for (const auto &f: outdated) {
+        std::error_code ec;
+        std::filesystem::remove(f, ec);
+    }
+}
+
+std::vector<PageBuilder::Chunks> ProjectBuilder::make_chunks(const std::vector<FileList> &lists, bool scripts, ChunkContent &content) {
+    //pages using each file
+    std::unordered_map<std::filesystem::path, std::vector<std::size_t> > users;
+    for (std::size_t i = 0; i < lists.size(); ++i) {
+        for (const auto &f: lists[i]) {
+            auto &u = users[f];
+            if (u.empty() || u.back() != i) u.push_back(i);
+        }
+    }
+    //files used by the same set of pages form a group, ordered as in the first page of the set
+    std::map<std::vector<std::size_t>, FileList> groups;
+    for (std::size_t i = 0; i < lists.size(); ++i) {
+        for (const auto &f: lists[i]) {
+            const auto &u = users[f];
+            if (u.size() > 1 && u.front() == i) groups[u].push_back(f);
+        }
+    }
+    //file can depend only on files used by the same or larger set of pages,
+    //so larger sets go first
+    std::vector<const std::pair<const std::vector<std::size_t>, FileList> *> order;
+    for (const auto &g: groups) order.push_back(&g);
+    std::stable_sort(order.begin(), order.end(), [](const auto *a, const auto *b){
+        return a->first.size() > b->first.size();
+    });
+
+    std::vector<PageBuilder::Chunks> out(lists.size());
+    auto &bld = *_pages.front().builder;
+    for (const auto *g: order) {
+        std::string data;
+        if (scripts) data.append("\"use strict\";\n");
+        for (const auto &f: g->second) {
+            auto c = scripts?bld.get_filtered_script(f):bld.get_filtered_style(f);
+            if (!c) {
+                _warning(f.string(), 0, "Failed to open file");
+                continue;
+            }
+            data.append(*c);
+            if (scripts) data.append(";\n");
+        }
+        std::string name ("chunk.");
+        name.append(PageBuilder::content_hash(data)).append(scripts?".js":".css");
+        content.emplace(name, std::make_shared<const std::string>(std::move(data)));
+        for (auto i: g->first) out[i].push_back({name, g->second, {}});
+    }
+    return out;
+}
+
+void ProjectBuilder::write_chunks(const std::vector<std::vector<std::string> > &old_chunks, const std::vector<std::vector<std::string> > &new_chunks, const ChunkContent &content, std::vector<std::filesystem::path> &outdated) {
+    std::set<std::filesystem::path> old_files;
+    std::set<std::filesystem::path> new_files;
+    for (std::size_t i = 0; i < _pages.size(); ++i) {
+        auto dir = _pages[i].target.parent_path();
+        for (const auto &n: old_chunks[i]) old_files.insert(dir / n);
+        for (const auto &n: new_chunks[i]) {
+            auto fname = dir / n;
+            if (!new_files.insert(fname).second) continue;
+            //name contains hash of the content, so existing file is up to date
+            auto gzname = fname;
+            gzname += ".gz";
+            std::error_code ec;
+            bool exists = std::filesystem::exists(fname, ec);
+            if (exists && (!_compress || std::filesystem::exists(gzname, ec))) continue;
+            const auto &data = *content.at(n);
+            std::filesystem::create_directories(dir);
+            if (!PageBuilder::write_file(fname, data)) {
+                _warning(fname.string(), 0, "Failed to write chunk");
+                continue;
+            }
+            if (_compress && !PageBuilder::write_file(gzname, gzip_compress(data))) {
+                _warning(gzname.string(), 0, "Failed to write compressed file");
+            }
+        }
+    }
+    for (const auto &f: old_files) {
+        if (new_files.count(f)) continue;
+        outdated.push_back(f);
+        auto gzname = f;
+        gzname += ".gz";
+        outdated.push_back(std::move(gzname));
+    }
+}
+
+std::vector<std::filesystem::path> ProjectBuilder::get_inputs() const {
+    std::vector<std::filesystem::path> out;
+    for (const auto &p: _pages) {
+        auto lst = p.builder->get_inputs();
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+std::vector<std::filesystem::path> ProjectBuilder::get_outputs() const {
+    std::vector<std::filesystem::path> out;
+    for (const auto &p: _pages) {
+        auto lst = p.builder->get_outputs();
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+std::vector<PageBuilder::BuiltAsset> ProjectBuilder::get_assets() const {
+    std::vector<PageBuilder::BuiltAsset> out;
+    for (const auto &p: _pages) {
+        auto lst = p.builder->get_assets();
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    //pages can share files and chunks
+    std::sort(out.begin(), out.end(), [](const auto &a, const auto &b){return a.file < b.file;});
+    out.erase(std::unique(out.begin(), out.end(), [](const auto &a, const auto &b){return a.file == b.file;}), out.end());
+    return out;
+}
+
+///write path escaped for make (ninja accepts the same escaping)
+static void write_make_path(std::ostream &out, const std::filesystem::path &p) {
+    for (char c: std::filesystem::absolute(p).string()) {
+        switch (c) {
+            case ' ':
+            case '#': out.put('\\');break;
+            case '$': out.put('$');break;
+            default: break;
+        }
+        out.put(c);
+    }
+}
+
+///update modification time of the generated file, the build doesn't rewrite unchanged files
+static void touch_output(const std::filesystem::path &p) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(p, ec)) return;
+    std::filesystem::last_write_time(p, std::filesystem::file_time_type::clock::now(), ec);
+}
+
+bool ProjectBuilder::write_depfile(const std::filesystem::path &fname) const {
+    return write_depfile(fname, get_outputs(), get_inputs());
+}
+
+bool ProjectBuilder::write_depfile(std::size_t idx, const std::filesystem::path &fname) const {
+    const auto &b = *_pages[idx].builder;
+    return write_depfile(fname, b.get_outputs(), b.get_inputs());
+}
+
+bool ProjectBuilder::write_depfile(const std::filesystem::path &fname, std::vector<std::filesystem::path> outputs, const std::vector<std::filesystem::path> &inputs) const {
+    //links share the inode (and the time) with their sources, so they can't be touched
+    //and they are not listed. They are never older than the source anyway
+    outputs.erase(std::remove_if(outputs.begin(), outputs.end(), [](const auto &p){
+        std::error_code ec;
+        if (std::filesystem::is_symlink(p, ec)) return true;
+        auto links = std::filesystem::hard_link_count(p, ec);
+        return !ec && links > 1;
+    }), outputs.end());
+    for (const auto &p: outputs) touch_output(p);
+    std::ofstream f(fname, std::ios::out|std::ios::trunc);
+    for (std::size_t i = 0; i < outputs.size(); ++i) {
+        if (i) f << " \\\n ";
+        write_make_path(f, outputs[i]);
+    }
+    f << ":";
+    for (const auto &p: inputs) {
+        f << " \\\n ";
+        write_make_path(f, p);
+    }
+    f << "\n";
+    for (const auto &p: inputs) {
+        f << "\n";
+        write_make_path(f, p);
+        f << ":\n";
+    }
+    f.close();
+    if (!f) {
+        _warning(fname.string(), 0, "Failed to write dependency file");
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::filesystem::path> ProjectBuilder::get_search_dirs() const {
+    std::vector<std::filesystem::path> out;
+    for (const auto &p: _pages) {
+        auto lst = p.builder->get_search_dirs();
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef _builder_src_project_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_project_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include "builder.h"
+
+///Builds multiple pages
+/**
+ * Every page has its own PageBuilder, but all builders share single cache of parsed
+ * and filtered sources, so common scripts are processed only once. Optionally, scripts
+ * and styles used by multiple pages are moved to shared chunks
+ */
+class ProjectBuilder {
+public:
+
+    ProjectBuilder(PageBuilder::WaringOut wout):_warning(std::move(wout)),_cache(std::make_shared<BuildCache>()) {}
+
+    ///Add page to the project
+    /**
+     * @param source main script of the page
+     * @param target target page
+     */
+    void add_page(std::filesystem::path source, std::filesystem::path target);
+
+    ///Enable shared chunks
+    /**
+     * Scripts and styles used by more than one page are moved to chunk files. Files used by
+     * the same set of pages share one chunk. Name of the chunk contains hash of its content
+     *
+     * @param enable true to enable
+     */
+    void set_shared_chunks(bool enable) {_shared = enable;}
+
+    ///@see PageBuilder::set_minify
+    void set_minify(bool enable, PageBuilder::MinifyReport report = nullptr);
+    ///@see PageBuilder::set_compress
+    void set_compress(bool enable);
+    ///@see PageBuilder::set_fingerprint
+    void set_fingerprint(bool enable);
+
+    ///load states of all pages
+    void load_state();
+    ///prepare all pages
+    void prepare(const SearchPaths &paths);
+    ///build all pages
+    /**
+     * @param mode build mode
+     * @param write_pages write pages to their targets, if false, pages are only built in memory
+     */
+    void build(BuildMode mode, bool write_pages = true);
+
+    ///count of pages
+    std::size_t size() const {return _pages.size();}
+    ///target of the page
+    const std::filesystem::path &get_target(std::size_t idx) const {return _pages[idx].target;}
+    ///builder of the page
+    const PageBuilder &get_builder(std::size_t idx) const {return *_pages[idx].builder;}
+
+    ///retrieve all source files of all pages
+    std::vector<std::filesystem::path> get_inputs() const;
+    ///retrieve all search paths
+    std::vector<std::filesystem::path> get_search_dirs() const;
+    ///retrieve all files generated by last build
+    std::vector<std::filesystem::path> get_outputs() const;
+    ///retrieve manifest of files published by last build (see PageBuilder::get_assets()), sorted by file
+    std::vector<PageBuilder::BuiltAsset> get_assets() const;
+
+    ///Write dependency file in Makefile format
+    /**
+     * The file contains single rule, where all generated files depend on all source
+     * files of all pages. Every source has also an empty rule, so the build doesn't
+     * fail when a source is removed. Paths are absolute. Can be used by make, ninja
+     * and CMake's add_custom_command(DEPFILE)
+     *
+     * The build doesn't rewrite unchanged files, so the function also updates
+     * modification time of all listed targets. Otherwise the build system would
+     * consider them outdated whenever other source changes. Symlinked and hardlinked
+     * files are not listed, because they share the time with their sources
+     *
+     * @param fname name of the dependency file
+     * @retval true written
+     * @retval false failed to write (reported as warning)
+     */
+    bool write_depfile(const std::filesystem::path &fname) const;
+    ///Write dependency file of single page
+    /**
+     * Same as write_depfile(fname), but the rule contains only files of the page
+     *
+     * @param idx index of the page
+     * @param fname name of the dependency file
+     * @retval true written
+     * @retval false failed to write (reported as warning)
+     */
+    bool write_depfile(std::size_t idx, const std::filesystem::path &fname) const;
+
+protected:
+
+    struct Page {
+        std::filesystem::path source;
+        std::filesystem::path target;
+        std::unique_ptr<PageBuilder> builder;
+    };
+
+    PageBuilder::WaringOut _warning;
+    std::shared_ptr<BuildCache> _cache;
+    std::vector<Page> _pages;
+    bool _shared = false;
+    bool _compress = false;
+
+    using FileList = std::vector<std::filesystem::path>;
+    using ChunkContent = std::unordered_map<std::string, BuildCache::Content>;
+
+    std::vector<PageBuilder::Chunks> make_chunks(const std::vector<FileList> &lists, bool scripts, ChunkContent &content);
+    void write_chunks(const std::vector<std::vector<std::string> > &old_chunks, const std::vector<std::vector<std::string> > &new_chunks, const ChunkContent &content, std::vector<std::filesystem::path> &outdated);
+    bool write_depfile(const std::filesystem::path &fname, std::vector<std::filesystem::path> outputs, const std::vector<std::filesystem::path> &inputs) const;
+};
+
+
+#endif
@@ -0,0 +1,149 @@
+#include "response_cache.h"
+#include "compress.h"
+
+#include <cstdio>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int open_regular(const std::filesystem::path &p, struct stat &st) {
+    int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd >= 0 && (::fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static std::shared_ptr<const std::string> read_file(int fd, std::size_t size) {
+    std::string data;
+    data.resize(size);
+    std::size_t pos = 0;
+    while (pos < size) {
+        auto r = ::read(fd, data.data()+pos, size - pos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        pos += r;
+    }
+    ::close(fd);
+    //file has been truncated meanwhile
+    if (pos != size) return nullptr;
+    return std::make_shared<const std::string>(std::move(data));
+}
+
+void ResponseCache::prepare(Entry &e, Variant &v, std::string etag, std::shared_ptr<const std::string> body, bool gzip, bool vary) {
+    v.etag.append("\"").append(etag).append("\"");
+    std::string common;
+    common.append("\r\nETag: ").append(v.etag);
+    if (e.last_modified) common.append("\r\nLast-Modified: ").append(HttpServer::http_date(e.last_modified));
+    if (!e.cache_control.empty()) common.append("\r\nCache-Control: ").append(e.cache_control);
+    if (vary) common.append("\r\nVary: Accept-Encoding");
+    v.header_304.append("HTTP/1.1 304 Not modified").append(common);
+    v.header.append("HTTP/1.1 200 OK\r\nContent-Type: ").append(e.content_type).append(common);
+    if (gzip) v.header.append("\r\nContent-Encoding: gzip");
+    //range requests of files are passed to other handler
+    if (!e.source) v.header.append("\r\nAccept-Ranges: bytes");
+    v.header.append("\r\nContent-Length: ").append(std::to_string(body->size()));
+    v.body = std::move(body);
+}
+
+void ResponseCache::update(const std::vector<Asset> &assets) {
+    std::lock_guard _(_update_lock);
+    auto prev = _snapshot.load();
+    auto snapshot = std::make_shared<Snapshot>();
+    for (const auto &a: assets) {
+        std::shared_ptr<const Entry> old;
+        if (prev) {
+            auto iter = prev->find(a.path);
+            if (iter != prev->end() && iter->second->cache_control == a.cache_control) old = iter->second;
+        }
+        auto e = std::make_shared<Entry>();
+        std::string etag;
+        if (a.data) {
+            if (old && old->source == a.data) {
+                snapshot->emplace(a.path, std::move(old));
+                continue;
+            }
+            e->source = a.data;
+            e->last_modified = a.last_modified;
+            etag = a.etag;
+        } else {
+            struct stat st;
+            if (::stat(a.file.c_str(), &st) || !S_ISREG(st.st_mode)
+                    || static_cast<std::uint64_t>(st.st_size) > _max_file_size) continue;
+            e->ino = st.st_ino;
+            e->mtime = static_cast<std::uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+            e->size = st.st_size;
+            if (old && !old->source && std::tie(old->ino, old->mtime, old->size) == std::tie(e->ino, e->mtime, e->size)) {
+                snapshot->emplace(a.path, std::move(old));
+                continue;
+            }
+            int fd = open_regular(a.file, st);
+            if (fd < 0) continue;
+            e->last_modified = st.st_mtime;
+            char buff[64];
+            std::snprintf(buff, sizeof(buff), "%llx-%llx-%llx",
+                    static_cast<unsigned long long>(e->ino),
+                    static_cast<unsigned long long>(e->mtime),
+                    static_cast<unsigned long long>(e->size));
+            etag = buff;
+            auto data = read_file(fd, st.st_size);
+            if (!data) continue;
+            e->identity.body = std::move(data);
+        }
+        e->file = a.file;
+        e->content_type = content_type_of(a.file.filename().native());
+        e->cache_control = a.cache_control;
+        auto body = a.data?a.data:e->identity.body;
+        //small files are not worth to compress
+        bool gzip = is_compressible(e->content_type) && body->size() > 256;
+        if (gzip) {
+            std::shared_ptr<const std::string> gz_body;
+            if (a.compressed && !a.data) {
+                //use precompressed file, if it is not older than the original
+                auto gz_path = a.file;
+                gz_path += ".gz";
+                struct stat gz_st;
+                int gz_fd = open_regular(gz_path, gz_st);
+                if (gz_fd >= 0) {
+                    if (static_cast<std::uint64_t>(gz_st.st_mtim.tv_sec) * 1000000000ULL + gz_st.st_mtim.tv_nsec >= e->mtime) {
+                        gz_body = read_file(gz_fd, gz_st.st_size);
+                    } else {
+                        ::close(gz_fd);
+                    }
+                }
+            }
+            if (!gz_body) gz_body = std::make_shared<const std::string>(gzip_compress(*body));
+            prepare(*e, e->gzip, etag + "-gz", std::move(gz_body), true, true);
+        }
+        prepare(*e, e->identity, std::move(etag), std::move(body), false, gzip);
+        snapshot->emplace(a.path, std::move(e));
+    }
+    _snapshot.store(std::move(snapshot));
+}
+
+bool ResponseCache::serve(HttpServer::Request &req) const {
+    auto snapshot = _snapshot.load();
+    if (!snapshot) return false;
+    auto iter = snapshot->find(req.subpath.substr(0, req.subpath.find('?')));
+    if (iter == snapshot->end()) return false;
+    const auto &e = iter->second;
+    //content in memory ignores ranges, whole content is sent
+    if (!e->source && !req.header("Range").empty()) return false;
+    bool gzip = e->gzip.body && req.accepts_encoding("gzip");
+    const Variant &v = gzip?e->gzip:e->identity;
+    if (req.is_fresh(v.etag, e->last_modified)) {
+        if (_log) _log(req, e->file, "not modified");
+        req.send_prepared(304, "", v.header_304, {}, e);
+    } else {
+        if (_log) _log(req, e->file, e->content_type);
+        req.send_prepared(200, e->content_type, v.header, *v.body, e);
+    }
+    return true;
+}
+
+std::size_t ResponseCache::size() const {
+    auto snapshot = _snapshot.load();
+    return snapshot?snapshot->size():0;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#ifndef _builder_src_response_cache_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_response_cache_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include "server.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+///Serves prepared responses of published files from memory
+/**
+ * The cache is filled by update() with a list of files (manifest of the build). For
+ * every file, the response header and the body are prepared in advance - identity and
+ * gzip variant (for compressible content), and the 304 response. The request is
+ * then answered by a lookup in a hash map and single send without formatting, allocations
+ * and access to the filesystem. Content is loaded to memory (files can't be mapped,
+ * because linked files share inode with the sources, which can be truncated by an editor)
+ *
+ * update() builds new snapshot of the cache and replaces the current one atomically, so
+ * requests being processed finish with the previous content. Entries of unchanged files
+ * are taken from the previous snapshot
+ *
+ * Files are assumed to change only by the build, which is followed by update(). Requests
+ * not found in the cache, range requests and files larger than the limit are left to other
+ * handler (for example StaticFileHandler)
+ */
+class ResponseCache {
+public:
+
+    ///Receives request, file and result (content type or "not modified")
+    using Log = std::function<void(const HttpServer::Request &req, const std::filesystem::path &file, std::string_view result)>;
+
+    ///Published file
+    struct Asset {
+        ///path of the request, must begin with '/'
+        std::string path;
+        ///file to load (if data are not set). It is also passed to the log
+        std::filesystem::path file;
+        ///content in memory (instead of the file)
+        std::shared_ptr<const std::string> data;
+        ///entity tag of the content in memory (without quotes, files use their stamp)
+        std::string etag;
+        ///last modification of the content in memory
+        std::time_t last_modified = 0;
+        ///compressed copy of the file (file.gz) is available
+        bool compressed = false;
+        ///value of Cache-Control header (optional)
+        std::string cache_control;
+    };
+
+    ///Replace content of the cache
+    /**
+     * Missing files and files larger than the limit are skipped
+     *
+     * @param assets list of files. Paths must be unique
+     */
+    void update(const std::vector<Asset> &assets);
+
+    ///Handle the request
+    /**
+     * @param req request
+     * @retval true response has been sent
+     * @retval false not handled (not in the cache or range request of a file), pass it to other handler
+     */
+    bool serve(HttpServer::Request &req) const;
+
+    ///Set maximum size of cached file (default 4 MiB)
+    void set_max_file_size(std::uint64_t sz) {_max_file_size = sz;}
+    ///Set log function
+    /**
+     * @note must be called before the cache is used by the server
+     */
+    void set_log(Log log) {_log = std::move(log);}
+
+    ///count of cached files
+    std::size_t size() const;
+
+protected:
+
+    ///prepared response
+    struct Variant {
+        ///header of response 200 (without Connection header)
+        std::string header;
+        ///header of response 304 (without Connection header)
+        std::string header_304;
+        ///quoted entity tag
+        std::string etag;
+        std::shared_ptr<const std::string> body;
+    };
+
+    struct Entry {
+        Variant identity;
+        ///body is not set when the content is not compressed
+        Variant gzip;
+        std::filesystem::path file;
+        std::string_view content_type;
+        std::time_t last_modified;
+        std::string cache_control;
+        ///content in memory, which has been used to prepare the entry
+        std::shared_ptr<const std::string> source;
+        ///stamp of the file, which has been used to prepare the entry
+        std::uint64_t ino = 0, mtime = 0, size = 0;
+    };
+
+    ///allows lookup by string_view
+    struct PathHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view s) const {return std::hash<std::string_view>()(s);}
+    };
+
+    using Snapshot = std::unordered_map<std::string, std::shared_ptr<const Entry>, PathHash, std::equal_to<> >;
+
+    std::atomic<std::shared_ptr<const Snapshot> > _snapshot;
+    ///serializes updates
+    std::mutex _update_lock;
+    std::uint64_t _max_file_size = 4*1024*1024;
+    Log _log;
+
+    static void prepare(Entry &e, Variant &v, std::string etag, std::shared_ptr<const std::string> body, bool gzip, bool vary);
+};
+
+
+#endif
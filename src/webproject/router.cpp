@@ -0,0 +1,64 @@
+#include "router.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+const HttpRouter::Route *HttpRouter::find(const std::vector<Route> &table, std::string_view path) {
+    auto iter = std::lower_bound(table.begin(), table.end(), path, [](const Route &r, std::string_view p){
+        return r.path < p;
+    });
+    if (iter == table.end() || iter->path != path) return nullptr;
+    return &(*iter);
+}
+
+void HttpRouter::insert(std::vector<Route> &table, std::string path, Handler h) {
+    auto iter = std::lower_bound(table.begin(), table.end(), path, [](const Route &r, std::string_view p){
+        return r.path < p;
+    });
+    if (iter != table.end() && iter->path == path) {
+        throw std::invalid_argument("HttpRouter: route already exists: " + path);
+    }
+    table.insert(iter, Route{std::move(path), std::move(h)});
+}
+
+void HttpRouter::add_exact(std::string_view path, Handler h) {
+    if (path.empty() || path[0] != '/') throw std::invalid_argument("HttpRouter: path must begin with '/'");
+    insert(_exact, std::string(path), std::move(h));
+}
+
+void HttpRouter::add_prefix(std::string_view prefix, Handler h) {
+    if (prefix.empty() || prefix[0] != '/') throw std::invalid_argument("HttpRouter: path must begin with '/'");
+    while (!prefix.empty() && prefix.back() == '/') prefix = prefix.substr(0, prefix.size()-1);
+    insert(_prefix, std::string(prefix), std::move(h));
+}
+
+void HttpRouter::operator()(HttpServer::Request &req) const {
+    std::string_view path = req.path.substr(0, req.path.find('?'));
+    if (const Route *r = find(_exact, path)) {
+        req.subpath = "/";
+        r->handler(req);
+        return;
+    }
+    if (!_prefix.empty()) {
+        //candidates are the whole path and all its parents, from the longest
+        std::size_t len = path.size();
+        while (len > 0 && path[len-1] == '/') --len;
+        for (;;) {
+            if (const Route *r = find(_prefix, path.substr(0, len))) {
+                req.subpath = path.substr(len);
+                if (req.subpath.empty()) req.subpath = "/";
+                r->handler(req);
+                return;
+            }
+            if (len == 0) break;
+            len = path.rfind('/', len-1);
+            if (len == path.npos) break;
+        }
+    }
+    if (_not_found) {
+        req.subpath = path;
+        _not_found(req);
+    } else {
+        req.send(404, "Not found", "text/plain", "Not found");
+    }
+}
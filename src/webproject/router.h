@@ -0,0 +1,69 @@
+#pragma once
+#ifndef _builder_src_router_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_router_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include "server.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+///Routes requests to handlers by path
+/**
+ * Routes are registered at startup, then the router is passed to the HttpServer as its
+ * handler. Routes are kept in sorted tables, so the lookup is a binary search. Exact
+ * routes are checked first, then the longest matching prefix. Prefix matches whole
+ * segments of the path, prefix /ui matches /ui and /ui/index.html, but not /uix. Query
+ * is not part of the matched path
+ *
+ * The handler receives part of the path after the matched prefix in Request::subpath
+ * (for example /index.html for /ui/index.html), so it doesn't need to know where it is mounted
+ *
+ * @note routes can't be added while the server is running
+ */
+class HttpRouter {
+public:
+
+    using Handler = HttpServer::EndpointHandler;
+
+    ///Add route which matches exactly the path
+    /**
+     * @param path path, must begin with '/'
+     * @param h handler. Subpath of the request is "/"
+     * @exception std::invalid_argument route already exists or invalid path
+     */
+    void add_exact(std::string_view path, Handler h);
+
+    ///Add route which matches the path and all paths below
+    /**
+     * @param prefix prefix, must begin with '/'. Trailing '/' is ignored, prefix "/" matches all paths
+     * @param h handler
+     * @exception std::invalid_argument route already exists or invalid path
+     */
+    void add_prefix(std::string_view prefix, Handler h);
+
+    ///Set handler of requests, which don't match any route (default sends 404)
+    void set_not_found(Handler h) {_not_found = std::move(h);}
+
+    ///Dispatch request
+    void operator()(HttpServer::Request &req) const;
+
+protected:
+
+    struct Route {
+        std::string path;
+        Handler handler;
+    };
+
+    ///sorted by path
+    std::vector<Route> _exact;
+    ///sorted by path, paths are without trailing '/'
+    std::vector<Route> _prefix;
+    Handler _not_found;
+
+    static const Route *find(const std::vector<Route> &table, std::string_view path);
+    static void insert(std::vector<Route> &table, std::string path, Handler h);
+};
+
+
+#endif
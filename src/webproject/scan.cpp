@@ -0,0 +1,79 @@
+#include "scan.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define WEBPROJECT_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static const char *scan_scalar(const ScanSet &set, const char *b, const char *e) {
+    for (; b != e; ++b) {
+        for (unsigned int i = 0; i < set.size; ++i) {
+            if (*b == set.chars[i]) return b;
+        }
+    }
+    return b;
+}
+
+#ifdef WEBPROJECT_SCAN_X86
+
+static const char *scan_sse2(const ScanSet &set, const char *b, const char *e) {
+    __m128i needles[ScanSet::max_size];
+    for (unsigned int i = 0; i < set.size; ++i) needles[i] = _mm_set1_epi8(set.chars[i]);
+    while (e - b >= 16) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+        __m128i match = _mm_setzero_si128();
+        for (unsigned int i = 0; i < set.size; ++i) {
+            match = _mm_or_si128(match, _mm_cmpeq_epi8(data, needles[i]));
+        }
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(match));
+        if (mask) return b + __builtin_ctz(mask);
+        b += 16;
+    }
+    return scan_scalar(set, b, e);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const ScanSet &set, const char *b, const char *e) {
+    __m256i needles[ScanSet::max_size];
+    for (unsigned int i = 0; i < set.size; ++i) needles[i] = _mm256_set1_epi8(set.chars[i]);
+    while (e - b >= 32) {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+        __m256i match = _mm256_setzero_si256();
+        for (unsigned int i = 0; i < set.size; ++i) {
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(data, needles[i]));
+        }
+        unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(match));
+        if (mask) return b + __builtin_ctz(mask);
+        b += 32;
+    }
+    return scan_sse2(set, b, e);
+}
+
+#endif
+
+using ScanFn = const char *(*)(const ScanSet &set, const char *b, const char *e);
+
+struct ScanKernel {
+    ScanFn fn;
+    std::string_view name;
+};
+
+static ScanKernel select_kernel() {
+#ifdef WEBPROJECT_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return {&scan_avx2, "avx2"};
+    return {&scan_sse2, "sse2"};
+#else
+    return {&scan_scalar, "scalar"};
+#endif
+}
+
+static const ScanKernel kernel = select_kernel();
+
+const char *scan_first_of(const ScanSet &set, const char *b, const char *e) {
+    return kernel.fn(set, b, e);
+}
+
+std::string_view scan_kernel_name() {
+    return kernel.name;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef _builder_src_scan_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_scan_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <array>
+#include <string_view>
+
+///Set of bytes to search by scan_first_of()
+struct ScanSet {
+    static constexpr unsigned int max_size = 8;
+    std::array<char, max_size> chars = {};
+    unsigned int size = 0;
+
+    constexpr ScanSet(std::string_view set) {
+        for (char c: set) {
+            if (size < max_size) chars[size++] = c;
+        }
+    }
+};
+
+///Find first byte which is in the set
+/**
+ * Uses the best available vector instruction set (AVX2, SSE2) selected at runtime,
+ * otherwise falls back to scalar code
+ *
+ * @param set set of bytes
+ * @param b begin of the buffer
+ * @param e end of the buffer
+ * @return pointer to the first found byte, or e if not found
+ */
+const char *scan_first_of(const ScanSet &set, const char *b, const char *e);
+
+///Retrieve name of the selected kernel (avx2, sse2, scalar)
+std::string_view scan_kernel_name();
+
+
+#endif
@@ -1,9 +1,22 @@
 #include "server.h"
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -11,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <variant>
+#include <vector>
 
 
 static std::string_view unixPrefix = "unix:";
@@ -19,7 +33,120 @@ static std::string_view status404 ="404 Not found";
 static std::string_view status400 ="400 Bad request";
 static std::string_view status500 ="500 Internal server error";
 static std::string_view metrics_ctx = "application/openmetrics-text; version=1.0.0; charset=utf-8";
-static std::string_view metrics_path = "/metrics";
+///maximum size of request header
+static constexpr std::size_t max_header_size = 65536;
+
+///Opened file, closed when the last chunk referring it is released
+struct FileDescriptor {
+    int fd;
+    explicit FileDescriptor(int fd):fd(fd) {}
+    ~FileDescriptor() {::close(fd);}
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+};
+
+///Part of response waiting to be sent
+struct OutputChunk {
+    ///data to send (if file and view are not set)
+    std::string data;
+    ///data to send (instead of data), they are not copied
+    std::string_view view;
+    ///keeps data of the view alive (not set for static data)
+    std::shared_ptr<const void> owner;
+    ///file to send by sendfile()
+    std::shared_ptr<FileDescriptor> file;
+    ///current offset in the file
+    off_t offset = 0;
+    ///remaining bytes of the file
+    std::size_t length = 0;
+
+    OutputChunk() = default;
+    OutputChunk(std::string data):data(std::move(data)) {}
+    OutputChunk(std::shared_ptr<const std::string> shared):view(*shared),owner(std::move(shared)) {}
+    OutputChunk(std::string_view view, std::shared_ptr<const void> owner):view(view),owner(std::move(owner)) {}
+    OutputChunk(std::shared_ptr<FileDescriptor> file, off_t offset, std::size_t length)
+        :file(std::move(file)),offset(offset),length(length) {}
+
+    ///data to send (if file is not set)
+    std::string_view bytes() const {return view.data()?view:std::string_view(data);}
+};
+
+///Queue of output chunks
+/**
+ * Chunks are stored in a vector, which is cleared once all chunks are sent, so
+ * its capacity is reused by next responses and the queue doesn't allocate
+ * in steady state
+ */
+class OutputQueue {
+public:
+    bool empty() const {return _head == _items.size();}
+    std::size_t size() const {return _items.size() - _head;}
+    OutputChunk &front() {return _items[_head];}
+    OutputChunk &operator[](std::size_t idx) {return _items[_head+idx];}
+    void push_back(OutputChunk &&chunk) {_items.push_back(std::move(chunk));}
+    void pop_front() {
+        //release the data now, don't wait to clear()
+        _items[_head] = OutputChunk();
+        if (++_head == _items.size()) {
+            _items.clear();
+            _head = 0;
+        }
+    }
+protected:
+    std::vector<OutputChunk> _items;
+    std::size_t _head = 0;
+};
+
+///maximum count of chunks sent by single call
+static constexpr std::size_t max_iov = 16;
+
+class HttpServer::Connection {
+public:
+    Connection(int socket, std::shared_ptr<ServerMetrics> metrics):socket(socket),metrics(std::move(metrics)) {
+        this->metrics->connection_opened();
+    }
+    ~Connection() {
+        ::close(socket);
+        metrics->connection_closed();
+    }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    int socket;
+    ///metrics of the server
+    std::shared_ptr<ServerMetrics> metrics;
+    ///received data (can contain more pipelined requests)
+    std::string input;
+    ///data waiting to be sent
+    OutputQueue output;
+    ///count of bytes of the first output chunk already sent (if it is not a file)
+    std::size_t output_pos = 0;
+    ///count of processed requests
+    unsigned int requests = 0;
+    ///current response keeps connection open
+    bool keep_alive = false;
+    ///close connection once output is sent
+    bool closing = false;
+    ///peer closed its side of connection
+    bool eof = false;
+    ///connection is waiting for an event (so it can be closed when idle)
+    std::atomic<bool> waiting = false;
+    ///time of last activity (steady clock, in seconds)
+    std::atomic<std::int64_t> last_activity = 0;
+
+    ///read all available data
+    /**
+     * @retval true connection is still open
+     * @retval false connection has been closed or reset
+     */
+    bool read_available();
+    ///send as much of pending data as possible without blocking
+    /**
+     * @retval true success (some data can remain in output when socket is full)
+     * @retval false connection has been reset, no write is possible
+     */
+    bool flush();
+};
 
 struct IPv4Addr {
     sockaddr_in addr;
@@ -36,7 +163,7 @@ struct IPv4Addr {
         }
     }
     int socket() const {
-        return ::socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, IPPROTO_TCP);
+        return ::socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, IPPROTO_TCP);
     }
 };
 
@@ -55,7 +182,7 @@ struct UnixAddr {
         chmod(fname.c_str(), perms);
     }
     int socket() const {
-        return ::socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        return ::socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
     }
 };
 
@@ -117,6 +244,9 @@ ListenAddr resolve_addr(const std::string &address, unsigned int port) {
 HttpServer::HttpServer(int port, std::string address, EndpointHandler h)
 :_h(std::move(h))
 {
+    //sendfile() can't suppress SIGPIPE as sendmsg() does (MSG_NOSIGNAL), a client closing
+    //the connection during the transfer would kill the process
+    std::signal(SIGPIPE, SIG_IGN);
     //resolve entered address
     auto addr = resolve_addr(address, port);
     //create mother socket
@@ -131,7 +261,39 @@ HttpServer::HttpServer(int port, std::string address, EndpointHandler h)
             int e = errno;
             throw std::system_error(e, std::system_category(), "MetricHttpServer: Can't listen socket");
         }
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (_epoll < 0) {
+            int e = errno;
+            throw std::system_error(e, std::system_category(), "MetricHttpServer: Can't create epoll");
+        }
+        _wakeup = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (_wakeup < 0) {
+            int e = errno;
+            throw std::system_error(e, std::system_category(), "MetricHttpServer: Can't create eventfd");
+        }
+        _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (_timer < 0) {
+            int e = errno;
+            throw std::system_error(e, std::system_category(), "MetricHttpServer: Can't create timerfd");
+        }
+        itimerspec tm = {{1,0},{1,0}};
+        timerfd_settime(_timer, 0, &tm, nullptr);
+        epoll_event ev = {};
+        //wakeup is level triggered, so it wakes all workers
+        ev.events = EPOLLIN;
+        ev.data.ptr = &_wakeup;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+        //mother is oneshot - only one worker accepts connections
+        ev.events = EPOLLIN|EPOLLONESHOT;
+        ev.data.ptr = &_mother;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, mother, &ev);
+        //timer is oneshot - only one worker checks idle connections
+        ev.data.ptr = &_timer;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _timer, &ev);
     } catch (...) {
+        if (_timer >= 0) ::close(_timer);
+        if (_wakeup >= 0) ::close(_wakeup);
+        if (_epoll >= 0) ::close(_epoll);
         ::close(mother);
         throw;
     }
@@ -140,152 +302,630 @@ HttpServer::HttpServer(int port, std::string address, EndpointHandler h)
 
 }
 
-///read socket until sequence has been detected, rest of the data are discarded
-/**mostly need to read until "\r\n\r\n" found
- *
- * @param conn connection
- * @param buffer buffer - will contain result
- * @param endseq end sequence
- * @retval true success
- * @retval false connection has been closed
- */
-
-static bool read_until(int conn, std::string &buffer, std::string_view endseq) {
-    buffer.clear();
-    std::array<char, 1500> tmp;
-    for(;;) {
-        int r = recv(conn, tmp.data(), tmp.size(), 0);
+bool HttpServer::Connection::read_available() {
+    std::array<char, 4096> tmp;
+    while (input.size() < max_header_size) {
+        auto r = recv(socket, tmp.data(), tmp.size(), 0);
         if (r < 0) {
             if (errno == EINTR) continue;
-            return false;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
         if (r == 0) {
             return false;
         }
-        buffer.append(tmp.data(), r);
-        auto pos = buffer.find(endseq);
-        if (pos != buffer.npos) {
-            buffer.resize(pos);
-            return true;
-        }
+        input.append(tmp.data(), r);
     }
+    return true;
 }
 
-///send whole string to the connection
-/**
- * @param conn connection
- * @param data data to write
- * @retval true success
- * @retval false connection has been reset, no write is possible
- */
-static bool write_all(int conn, std::string_view data) {
-    while (!data.empty()) {
-        int r = send(conn, data.data(), data.size(),0);
-        if (r<=0) return false;
-        data = data.substr(r);
+bool HttpServer::Connection::flush() {
+    while (!output.empty()) {
+        auto &chunk = output.front();
+        ssize_t r;
+        if (chunk.file) {
+            if (chunk.length == 0) {
+                output.pop_front();
+                continue;
+            }
+            r = ::sendfile(socket, chunk.file->fd, &chunk.offset, chunk.length);
+            //file has been truncated, the promised length can't be sent
+            if (r == 0) return false;
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                //EPIPE, ECONNRESET - the client closed the connection, it is closed too
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            metrics->sent(r);
+            chunk.length -= r;
+            if (chunk.length == 0) output.pop_front();
+            continue;
+        }
+        //gather data up to next file, so the response is sent by single call
+        std::array<iovec, max_iov> iov;
+        std::size_t cnt = 0;
+        while (cnt < iov.size() && cnt < output.size() && !output[cnt].file) {
+            std::string_view data = output[cnt].bytes();
+            if (cnt == 0) data = data.substr(output_pos);
+            iov[cnt].iov_base = const_cast<char *>(data.data());
+            iov[cnt].iov_len = data.size();
+            ++cnt;
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = cnt;
+        int flags = MSG_NOSIGNAL | (output.size() > cnt?MSG_MORE:0);
+        r = ::sendmsg(socket, &msg, flags);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        metrics->sent(r);
+        std::size_t sent = r;
+        for (std::size_t i = 0; i < cnt; ++i) {
+            std::size_t remain = output.front().bytes().size() - output_pos;
+            if (sent < remain) {
+                output_pos += sent;
+                break;
+            }
+            sent -= remain;
+            output.pop_front();
+            output_pos = 0;
+        }
     }
     return true;
 }
 
 
-
-void HttpServer::send_status(std::string &buffer, int conn, std::string_view status_line, std::string_view extra_msg)  noexcept{
-    buffer.clear();
-    buffer.append("HTTP/1.0 ");
+void HttpServer::send_status(Connection &conn, std::string_view status_line, std::string_view extra_msg)  noexcept{
+    std::string body;
+    body.append(status_line);
+    body.append("\r\n");
+    if (!extra_msg.empty()) {
+        body.append("\r\n");
+        body.append(extra_msg);
+        body.append("\r\n");
+    }
+    std::string buffer;
+    buffer.append("HTTP/1.1 ");
     buffer.append(status_line);
     buffer.append("\r\n"
                  "Connection: close\r\n"
                  "Content-Type: text/plain\r\n"
-                 "Allow: GET\r\n\r\n");
-    buffer.append(status_line);
-    buffer.append("\r\n");
-    if (!extra_msg.empty()) {
-        buffer.append("\r\n");
-        buffer.append(extra_msg);
-        buffer.append("\r\n");
+                 "Allow: GET\r\n"
+                 "Content-Length: ");
+    buffer.append(std::to_string(body.size()));
+    buffer.append("\r\n\r\n");
+    buffer.append(body);
+    conn.output.push_back(std::move(buffer));
+    conn.keep_alive = false;
+    conn.metrics->response(std::atoi(std::string(status_line.substr(0,3)).c_str()), "text/plain");
+}
+
+static bool iequal(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y){
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+static std::string_view trim(std::string_view v) {
+    while (!v.empty() && std::isspace(static_cast<unsigned char>(v.front()))) v = v.substr(1);
+    while (!v.empty() && std::isspace(static_cast<unsigned char>(v.back()))) v = v.substr(0, v.size()-1);
+    return v;
+}
+
+std::string_view HttpServer::Request::header(std::string_view name) const {
+    std::string_view hdrs = headers;
+    while (!hdrs.empty()) {
+        auto eol = hdrs.find("\r\n");
+        auto line = hdrs.substr(0, eol);
+        hdrs = eol == hdrs.npos?std::string_view():hdrs.substr(eol+2);
+        auto sep = line.find(':');
+        if (sep != line.npos && iequal(trim(line.substr(0, sep)), name)) {
+            return trim(line.substr(sep+1));
+        }
     }
-    write_all(conn, buffer);
-    ::close(conn);
+    return {};
 }
 
-void HttpServer::serve(int conn, std::string &buff)  noexcept{
+void HttpServer::Request::add_header(std::string_view name, std::string_view value) {
+    extra.append("\r\n").append(name).append(": ").append(value);
+}
 
-    if (!read_until(conn, buff, "\r\n\r\n"))
-        return;
+bool HttpServer::Request::accepts_encoding(std::string_view coding) const {
+    std::string_view lst = header("Accept-Encoding");
+    bool any = false;
+    while (!lst.empty()) {
+        auto sep = lst.find(',');
+        auto item = lst.substr(0, sep);
+        lst = sep == lst.npos?std::string_view():lst.substr(sep+1);
+        auto params = item.find(';');
+        auto name = trim(item.substr(0, params));
+        bool accepted = true;
+        if (params != item.npos) {
+            auto q = trim(item.substr(params+1));
+            //q=0, q=0.0, q=0.000 - not acceptable
+            if (q.compare(0, 2, "q=") == 0) {
+                q = q.substr(2);
+                accepted = q.find_first_not_of("0.") != q.npos;
+            }
+        }
+        if (iequal(name, coding)) return accepted;
+        if (name == "*") any = accepted;
+    }
+    return any;
+}
+
+std::string HttpServer::http_date(std::time_t t) {
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    char buff[64];
+    return std::string(buff, std::strftime(buff, sizeof(buff), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+}
+
+static std::time_t parse_http_date(std::string_view date) {
+    std::tm tm = {};
+    char s[64];
+    if (date.size() >= sizeof(s)) return 0;
+    *std::copy(date.begin(), date.end(), s) = 0;
+    const char *e = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (e == nullptr) return 0;
+    return timegm(&tm);
+}
+
+bool HttpServer::Request::is_fresh(std::string_view etag, std::time_t last_modified) const {
+    std::string_view inm = header("If-None-Match");
+    if (!inm.empty()) {
+        //If-Modified-Since is ignored when If-None-Match is present
+        while (!inm.empty()) {
+            auto sep = inm.find(',');
+            auto item = trim(inm.substr(0, sep));
+            inm = sep == inm.npos?std::string_view():inm.substr(sep+1);
+            //weak comparison
+            if (item.compare(0, 2, "W/") == 0) item = item.substr(2);
+            if (item == "*" || item == etag) return true;
+        }
+        return false;
+    }
+    auto ims = header("If-Modified-Since");
+    std::time_t since = ims.empty()?0:parse_http_date(ims);
+    return last_modified && since && last_modified <= since;
+}
+
+bool HttpServer::Request::not_modified(std::string_view etag, std::time_t last_modified) {
+    std::string tag;
+    tag.append("\"").append(etag).append("\"");
+    add_header("ETag", tag);
+    if (last_modified) add_header("Last-Modified", http_date(last_modified));
+    bool match = is_fresh(tag, last_modified);
+    if (match) {
+        send(304, "Not modified", "", "");
+    }
+    return match;
+}
+
+///maximum count of ranges in single request, more ranges are ignored
+static constexpr std::size_t max_ranges = 16;
+
+static bool parse_uint(std::string_view v, std::uint64_t &out) {
+    if (v.empty() || v.size() > 19) return false;
+    out = 0;
+    for (char c: v) {
+        if (c < '0' || c > '9') return false;
+        out = out * 10 + (c - '0');
+    }
+    return true;
+}
+
+HttpServer::RangeStatus HttpServer::Request::ranges(std::uint64_t size, std::string_view etag, std::time_t last_modified, std::vector<ByteRange> &ranges) const {
+    ranges.clear();
+    std::string_view rng = header("Range");
+    if (rng.empty()) return RangeStatus::whole;
+    std::string_view ifr = header("If-Range");
+    if (!ifr.empty()) {
+        if (ifr.front() == '"' || ifr.compare(0, 2, "W/") == 0) {
+            //weak tag never matches
+            if (ifr.size() != etag.size() + 2 || ifr.front() != '"' || ifr.back() != '"'
+                    || ifr.substr(1, etag.size()) != etag) return RangeStatus::whole;
+        } else {
+            if (!last_modified || parse_http_date(ifr) != last_modified) return RangeStatus::whole;
+        }
+    }
+    auto eq = rng.find('=');
+    if (eq == rng.npos || !iequal(trim(rng.substr(0, eq)), "bytes")) return RangeStatus::whole;
+    rng = rng.substr(eq+1);
+    std::size_t count = 0;
+    while (!rng.empty()) {
+        auto sep = rng.find(',');
+        auto item = trim(rng.substr(0, sep));
+        rng = sep == rng.npos?std::string_view():rng.substr(sep+1);
+        if (item.empty()) continue;
+        if (++count > max_ranges) {
+            ranges.clear();
+            return RangeStatus::whole;
+        }
+        auto dash = item.find('-');
+        if (dash == item.npos) {
+            ranges.clear();
+            return RangeStatus::whole;
+        }
+        auto first = trim(item.substr(0, dash));
+        auto last = trim(item.substr(dash+1));
+        std::uint64_t a, b;
+        if (first.empty()) {
+            //suffix range - last b bytes
+            if (!parse_uint(last, b)) {
+                ranges.clear();
+                return RangeStatus::whole;
+            }
+            if (b == 0 || size == 0) continue;
+            b = std::min(b, size);
+            ranges.push_back({size - b, b});
+        } else {
+            if (!parse_uint(first, a) || (!last.empty() && (!parse_uint(last, b) || b < a))) {
+                ranges.clear();
+                return RangeStatus::whole;
+            }
+            if (a >= size) continue;
+            if (last.empty() || b >= size) b = size - 1;
+            ranges.push_back({a, b - a + 1});
+        }
+    }
+    if (count == 0) return RangeStatus::whole;
+    return ranges.empty()?RangeStatus::unsatisfiable:RangeStatus::partial;
+}
 
-    std::string_view path (buff);
+void HttpServer::serve(Connection &conn, std::size_t header_end)  noexcept{
+
+    std::string_view path (conn.input.data(), header_end);
+    std::string_view headers;
+    auto eol = path.find("\r\n");
+    if (eol != path.npos) {
+        headers = path.substr(eol+2);
+        path = path.substr(0, eol);
+    }
 
     if (path.compare(0,4, "GET ")) {
-        send_status(buff, conn, status405);
+        send_status(conn, status405);
         return;
     }
     path = path.substr(4);
     auto p = path.find(' ');
     if (p == path.npos) {
-        send_status(buff, conn, status400);
+        send_status(conn, status400);
         return;
     }
+    std::string_view version = path.substr(p+1);
     path = path.substr(0, p);
     if (path.empty() || path[0] != '/') {
-        send_status(buff, conn, status400);
+        send_status(conn, status400);
         return;
     }
 
     try {
 
-        Request req(path, conn);
+        Request req(path, headers, conn);
+        auto connection = req.header("Connection");
+        //request with a body is not supported, so connection can't be reused
+        bool has_body = !req.header("Transfer-Encoding").empty()
+                || (!req.header("Content-Length").empty() && req.header("Content-Length") != "0");
+        if (version == "HTTP/1.1") conn.keep_alive = !iequal(connection, "close");
+        else conn.keep_alive = iequal(connection, "keep-alive");
+        conn.keep_alive = conn.keep_alive && !has_body && conn.requests < _max_requests;
+        if (!_metrics_path.empty() && path.substr(0, path.find('?')) == _metrics_path) {
+            req.send(200, "OK", metrics_ctx, _metrics->render());
+            return;
+        }
         _h(req);
 
     } catch (std::exception &e) {
-        send_status(buff, conn, status500, e.what());
+        if (conn.output.empty()) send_status(conn, status500, e.what());
     } catch (...) {
-        send_status(buff, conn, status500);
+        if (conn.output.empty()) send_status(conn, status500);
+    }
+}
+
+void HttpServer::process(Connection &conn, std::uint32_t events) noexcept {
+    conn.waiting = false;
+    if (events & EPOLLERR) {
+        close(conn);
+        return;
+    }
+    for(;;) {
+        if (!conn.output.empty()) {
+            if (!conn.flush()) {
+                close(conn);
+                return;
+            }
+            if (!conn.output.empty()) {
+                //socket is full, wait until it is writable
+                rearm(conn, EPOLLOUT);
+                return;
+            }
+        }
+        if (conn.closing) {
+            close(conn);
+            return;
+        }
+        auto pos = conn.input.find("\r\n\r\n");
+        if (pos == conn.input.npos && !conn.eof) {
+            conn.eof = !conn.read_available();
+            pos = conn.input.find("\r\n\r\n");
+        }
+        if (pos == conn.input.npos) {
+            if (conn.eof) {
+                close(conn);
+            } else if (conn.input.size() < max_header_size) {
+                rearm(conn, EPOLLIN);
+            } else {
+                send_status(conn, status400, "Request header is too large");
+                conn.closing = true;
+                continue;
+            }
+            return;
+        }
+        ++conn.requests;
+        auto start = std::chrono::steady_clock::now();
+        serve(conn, pos);
+        conn.metrics->request_duration(std::chrono::steady_clock::now() - start);
+        conn.input.erase(0, pos+4);
+        if (!conn.keep_alive) conn.closing = true;
+    }
+}
+
+static std::int64_t steady_seconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void HttpServer::rearm(Connection &conn, std::uint32_t events) noexcept {
+    conn.last_activity = steady_seconds();
+    conn.waiting = true;
+    epoll_event ev = {};
+    ev.events = events|EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.ptr = &conn;
+    if (epoll_ctl(_epoll, EPOLL_CTL_MOD, conn.socket, &ev)) {
+        close(conn);
+    }
+}
+
+void HttpServer::close(Connection &conn) noexcept {
+    std::lock_guard _(_lock);
+    _connections.erase(&conn);
+}
+
+void HttpServer::accept_connections() noexcept {
+    for(;;) {
+        int s = ::accept4(_mother, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        auto c = std::make_unique<Connection>(s, _metrics);
+        auto *ptr = c.get();
+        ptr->last_activity = steady_seconds();
+        ptr->waiting = true;
+        {
+            std::lock_guard _(_lock);
+            _connections.emplace(ptr, std::move(c));
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+        ev.data.ptr = ptr;
+        if (epoll_ctl(_epoll, EPOLL_CTL_ADD, s, &ev)) {
+            close(*ptr);
+        }
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr = &_mother;
+    epoll_ctl(_epoll, EPOLL_CTL_MOD, _mother, &ev);
+}
+
+void HttpServer::close_idle() noexcept {
+    std::uint64_t v;
+    [[maybe_unused]] auto r = ::read(_timer, &v, sizeof(v));
+    auto limit = steady_seconds() - _idle_timeout.count();
+    {
+        std::lock_guard _(_lock);
+        for (const auto &[ptr, c]: _connections) {
+            //shutdown wakes the connection, the worker then closes it
+            if (c->waiting && c->last_activity < limit) ::shutdown(c->socket, SHUT_RDWR);
+        }
     }
+    epoll_event ev = {};
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr = &_timer;
+    epoll_ctl(_epoll, EPOLL_CTL_MOD, _timer, &ev);
 }
 
-void HttpServer::run(std::stop_token stop_token) {
+void HttpServer::set_keep_alive(std::chrono::seconds idle_timeout, unsigned int max_requests) {
+    _idle_timeout = idle_timeout;
+    _max_requests = std::max(1U, max_requests);
+}
+
+void HttpServer::worker() noexcept {
+    epoll_event ev;
+    for(;;) {
+        int r = epoll_wait(_epoll, &ev, 1, -1);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (r == 0) continue;
+        if (ev.data.ptr == &_wakeup) {
+            break;
+        }
+        if (ev.data.ptr == &_mother) {
+            accept_connections();
+        } else if (ev.data.ptr == &_timer) {
+            close_idle();
+        } else {
+            process(*static_cast<Connection *>(ev.data.ptr), ev.events);
+        }
+    }
+}
+
+void HttpServer::run(std::stop_token stop_token, unsigned int threads) {
 
     std::stop_callback cb(stop_token, [&]{
-        ::shutdown(SHUT_RD, _mother);
+        std::uint64_t v = 1;
+        [[maybe_unused]] auto r = ::write(_wakeup, &v, sizeof(v));
     });
-    std::string buffer;
-    int s = ::accept(_mother,0,0);
-    while (s >= 0) {
-        serve(s, buffer);
-        s = ::accept(_mother,0,0);
+    {
+        std::vector<std::jthread> pool;
+        for (unsigned int i = 1; i < threads; ++i) {
+            pool.emplace_back([this]{worker();});
+        }
+        worker();
     }
+    //reset wakeup, so the server can run again
+    std::uint64_t v;
+    [[maybe_unused]] auto r = ::read(_wakeup, &v, sizeof(v));
 }
 
 
 HttpServer::~HttpServer() {
+    _connections.clear();
+    if (_mother >= 0) ::close(_mother);
+    ::close(_timer);
+    ::close(_wakeup);
+    ::close(_epoll);
 }
 
-void HttpServer::Request::send(int code, std::string_view message, std::string_view content_type, std::string_view data)
-{
+static std::string response_header(int code, std::string_view message, std::string_view content_type, std::size_t length, bool keep_alive, std::string_view extra) {
     std::ostringstream bld;
-    bld << "HTTP/1.0 " << code << " " << message;
+    bld << "HTTP/1.1 " << code << " " << message;
     if (!content_type.empty()) bld << "\r\nContent-Type: " << content_type;
-    bld << "\r\nContent-Length:" << data.size();
-    bld << "\r\nConnection: close\r\n\r\n";
-    write_all(socket, bld.view());
-    write_all(socket, data);
-    ::close(socket);
-    socket = -1;
+    bld << extra;
+    if (code != 204 && code != 304) bld << "\r\nContent-Length: " << length;
+    bld << "\r\nConnection: " << (keep_alive?"keep-alive":"close") << "\r\n\r\n";
+    return std::move(bld).str();
+}
+
+void HttpServer::Request::send(int code, std::string_view message, std::string_view content_type, std::string_view data)
+{
+    conn->metrics->response(code, content_type);
+    conn->output.push_back(response_header(code, message, content_type, data.size(), conn->keep_alive, extra));
+    if (!data.empty()) conn->output.push_back(std::string(data));
+    conn = nullptr;
+}
+
+void HttpServer::Request::send(int code, std::string_view message, std::string_view content_type, std::shared_ptr<const std::string> data)
+{
+    conn->metrics->response(code, content_type);
+    conn->output.push_back(response_header(code, message, content_type, data->size(), conn->keep_alive, extra));
+    conn->output.push_back(OutputChunk(std::move(data)));
+    conn = nullptr;
 }
 
 void HttpServer::Request::send(int code, std::string_view message, std::string_view content_type, std::istream &data)
 {
-    std::ostringstream bld;
-    bld << "HTTP/1.0 " << code << " " << message;
-    if (!content_type.empty()) bld << "\r\nContent-Type: " << content_type;
-    bld << "\r\nConnection: close\r\n\r\n";
-    write_all(socket, bld.view());
+    std::deque<std::string> body;
+    std::size_t length = 0;
     std::array<char, 65536> buff;
     while (!!data) {
         data.read(buff.data(), buff.size());
-        std::string_view v(buff.data(), data.gcount());
-        write_all(socket, v);
+        if (data.gcount()) {
+            body.push_back(std::string(buff.data(), data.gcount()));
+            length += data.gcount();
+        }
     }
-    ::close(socket);
-    socket = -1;
+    conn->metrics->response(code, content_type);
+    conn->output.push_back(response_header(code, message, content_type, length, conn->keep_alive, extra));
+    for (auto &b: body) conn->output.push_back(std::move(b));
+    conn = nullptr;
+}
+
+void HttpServer::Request::send(int code, std::string_view message, std::string_view content_type, int fd)
+{
+    auto file = std::make_shared<FileDescriptor>(fd);
+    struct stat st;
+    if (::fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        throw std::runtime_error("Request::send: descriptor doesn't refer to a regular file");
+    }
+    std::size_t length = st.st_size;
+    conn->metrics->response(code, content_type);
+    conn->output.push_back(response_header(code, message, content_type, length, conn->keep_alive, extra));
+    conn->output.push_back(OutputChunk(std::move(file), 0, length));
+    conn = nullptr;
+}
+
+void HttpServer::Request::send_prepared(int code, std::string_view content_type, std::string_view header,
+                        std::string_view body, std::shared_ptr<const void> owner)
+{
+    static constexpr std::string_view keep_alive_end = "\r\nConnection: keep-alive\r\n\r\n";
+    static constexpr std::string_view close_end = "\r\nConnection: close\r\n\r\n";
+    conn->metrics->response(code, content_type);
+    conn->output.push_back(OutputChunk(header, owner));
+    if (!extra.empty()) conn->output.push_back(std::move(extra));
+    conn->output.push_back(OutputChunk(conn->keep_alive?keep_alive_end:close_end, nullptr));
+    if (!body.empty()) conn->output.push_back(OutputChunk(body, std::move(owner)));
+    conn = nullptr;
+}
+
+static std::string content_range(const HttpServer::ByteRange &r, std::uint64_t size) {
+    std::string out("bytes ");
+    out.append(std::to_string(r.offset)).append("-").append(std::to_string(r.offset + r.length - 1))
+       .append("/").append(std::to_string(size));
+    return out;
+}
+
+void HttpServer::Request::send_ranges(std::string_view content_type, int fd, const std::vector<ByteRange> &ranges)
+{
+    auto file = std::make_shared<FileDescriptor>(fd);
+    struct stat st;
+    if (::fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        throw std::runtime_error("Request::send_ranges: descriptor doesn't refer to a regular file");
+    }
+    std::uint64_t size = st.st_size;
+    for (const auto &r: ranges) {
+        if (r.length == 0 || r.offset + r.length > size) {
+            throw std::runtime_error("Request::send_ranges: range is out of the file");
+        }
+    }
+    if (ranges.size() == 1) {
+        const auto &r = ranges.front();
+        add_header("Content-Range", content_range(r, size));
+        conn->metrics->response(206, content_type);
+        conn->output.push_back(response_header(206, "Partial Content", content_type, r.length, conn->keep_alive, extra));
+        conn->output.push_back(OutputChunk(std::move(file), r.offset, r.length));
+        conn = nullptr;
+        return;
+    }
+    static std::atomic<std::uint64_t> counter = 0;
+    char boundary[40];
+    std::snprintf(boundary, sizeof(boundary), "webproject-%016llx",
+            static_cast<unsigned long long>(counter.fetch_add(1, std::memory_order_relaxed)
+                    ^ std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::vector<std::string> heads;
+    std::size_t length = 0;
+    for (const auto &r: ranges) {
+        std::string h("\r\n--");
+        h.append(boundary).append("\r\n");
+        if (!content_type.empty()) h.append("Content-Type: ").append(content_type).append("\r\n");
+        h.append("Content-Range: ").append(content_range(r, size)).append("\r\n\r\n");
+        length += h.size() + r.length;
+        heads.push_back(std::move(h));
+    }
+    std::string tail("\r\n--");
+    tail.append(boundary).append("--\r\n");
+    length += tail.size();
+    std::string ctx("multipart/byteranges; boundary=");
+    ctx.append(boundary);
+    conn->metrics->response(206, content_type);
+    conn->output.push_back(response_header(206, "Partial Content", ctx, length, conn->keep_alive, extra));
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        conn->output.push_back(std::move(heads[i]));
+        conn->output.push_back(OutputChunk(file, ranges[i].offset, ranges[i].length));
+    }
+    conn->output.push_back(std::move(tail));
+    conn = nullptr;
+}
+
+void HttpServer::Request::send_unsatisfiable(std::uint64_t size)
+{
+    add_header("Content-Range", "bytes */" + std::to_string(size));
+    conn->metrics->response(416, "");
+    conn->output.push_back(response_header(416, "Range Not Satisfiable", "", 0, conn->keep_alive, extra));
+    conn = nullptr;
 }
@@ -8,77 +8,279 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <exception>
 #include <functional>
 #include <stop_token>
+#include <unordered_map>
+#include <vector>
 
+#include "metrics.h"
 
 class HttpServer {
 public:
 
+    ///Connection state - opaque, defined by the server
+    class Connection;
+
+    ///Range of bytes of the content
+    struct ByteRange {
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    ///Result of evaluation of the Range header
+    enum class RangeStatus {
+        ///send whole content (no Range header, invalid header or If-Range doesn't match)
+        whole,
+        ///send requested ranges (206 Partial Content)
+        partial,
+        ///no requested range overlaps the content (416 Range Not Satisfiable)
+        unsatisfiable
+    };
+
     class Request {
     public:
 
-        Request(std::string_view path, int socket):path(path),socket(socket) {}
-        Request(Request &&other):path(other.path),socket(other.socket){other.socket = -1;}
+        Request(std::string_view path, std::string_view headers, Connection &conn):path(path),subpath(path),headers(headers),conn(&conn) {}
+        Request(Request &&other):path(other.path),subpath(other.subpath),headers(other.headers),conn(other.conn),extra(std::move(other.extra)){other.conn = nullptr;}
         ~Request() {
-            if (socket != -1) {
+            //when handler throws, the server reports error instead
+            if (conn && !std::uncaught_exceptions()) {
                 send(204, "No content","","");
             }
         }
+        ///Send response
+        /**
+         * The response is queued and sent by the server once the connection is ready to accept
+         * the data. The function never blocks on network
+         */
         void send(int code, std::string_view message, std::string_view content_type, std::string_view data);
+        ///Send shared buffer, the buffer is not copied, it is held until it is sent
+        void send(int code, std::string_view message, std::string_view content_type, std::shared_ptr<const std::string> data);
         void send(int code, std::string_view message, std::string_view content_type, std::istream &data);
+        ///Send preformatted response
+        /**
+         * The header and the body are queued without copying and formatting, they are kept
+         * alive by the owner until they are sent. Headers added by add_header() and the
+         * Connection header are appended to the header. All parts are sent by single call
+         * (when the socket accepts them)
+         *
+         * @param code status code (for metrics)
+         * @param content_type content type (for metrics)
+         * @param header status line and headers, each header preceded by "\r\n", without final
+         * empty line. It must include Content-Length (except 304)
+         * @param body body of the response
+         * @param owner owner of the header and the body
+         */
+        void send_prepared(int code, std::string_view content_type, std::string_view header,
+                        std::string_view body, std::shared_ptr<const void> owner);
+        ///Send content of a file
+        /**
+         * The file is sent by sendfile() without copying through user space. Content-Length
+         * is set to the size of the file
+         *
+         * @param fd descriptor of opened regular file. The function takes ownership,
+         * the descriptor is closed once the file is sent
+         */
+        void send(int code, std::string_view message, std::string_view content_type, int fd);
+
+        ///Retrieve value of request header
+        /**
+         * @param name name of header (case insensitive)
+         * @return value of the header, empty if not present
+         */
+        std::string_view header(std::string_view name) const;
+
+        ///Add header to the response
+        /**
+         * Must be called before send(). The header is included in the response
+         *
+         * @param name name of the header
+         * @param value value of the header
+         */
+        void add_header(std::string_view name, std::string_view value);
+
+        ///Determines whether client accepts given content coding
+        /**
+         * Parses Accept-Encoding header including quality values
+         *
+         * @param coding content coding, for example "gzip"
+         * @retval true client accepts the coding
+         * @retval false client doesn't accept the coding
+         */
+        bool accepts_encoding(std::string_view coding) const;
+
+        ///Handle conditional request
+        /**
+         * Adds ETag and Last-Modified to the response and evaluates If-None-Match and
+         * If-Modified-Since. When the client has current version, the response 304 is sent.
+         * Headers added by add_header() are included in both cases
+         *
+         * @param etag strong entity tag (without quotes). Must differ for each content encoding
+         * @param last_modified time of last modification. Set 0 if unknown
+         * @retval true response 304 has been sent, the request is finished
+         * @retval false client needs the content, continue with send()
+         */
+        bool not_modified(std::string_view etag, std::time_t last_modified);
+
+        ///Evaluate If-None-Match and If-Modified-Since
+        /**
+         * Same as not_modified(), but the response is not touched
+         *
+         * @param etag quoted entity tag (value of the ETag header)
+         * @param last_modified time of last modification. Set 0 if unknown
+         * @retval true client has current version
+         * @retval false client needs the content
+         */
+        bool is_fresh(std::string_view etag, std::time_t last_modified) const;
+
+        ///Evaluate Range and If-Range headers
+        /**
+         * Only byte ranges are supported. Ranges are clamped to the size of the content,
+         * unsatisfiable ranges are dropped. Invalid header or too many ranges are ignored
+         * (whole content is sent). If-Range is compared with the validators of the
+         * current content, when it doesn't match, whole content is sent
+         *
+         * @param size size of the content
+         * @param etag strong entity tag of the content (without quotes)
+         * @param last_modified time of last modification (0 if unknown)
+         * @param ranges (output) satisfiable ranges in order of the request
+         * @return result of evaluation
+         */
+        RangeStatus ranges(std::uint64_t size, std::string_view etag, std::time_t last_modified, std::vector<ByteRange> &ranges) const;
+
+        ///Send ranges of a file (206 Partial Content)
+        /**
+         * Single range is sent with Content-Range header, multiple ranges are sent as
+         * multipart/byteranges. Parts are sent by sendfile() from given offsets
+         *
+         * @param content_type content type of the file
+         * @param fd descriptor of opened regular file. The function takes ownership
+         * @param ranges ranges to send (see ranges())
+         */
+        void send_ranges(std::string_view content_type, int fd, const std::vector<ByteRange> &ranges);
+
+        ///Send 416 Range Not Satisfiable
+        /**
+         * @param size size of the content
+         */
+        void send_unsatisfiable(std::uint64_t size);
 
         std::string_view path;
-    protected:        
-        int socket;                
+        ///part of the path handled by the handler (without prefix of the route, see HttpRouter)
+        std::string_view subpath;
+        ///all request headers (without request line)
+        std::string_view headers;
+    protected:
+        Connection *conn;
+        ///extra response headers
+        std::string extra;
     };
 
 
     using EndpointHandler  = std::function<void(Request &req)>;
 
 
+    ///Create server and bind it to the address
+    /**
+     * @note the constructor sets SIGPIPE to be ignored by the process. Files are sent
+     * by sendfile(), which would raise the signal when the client closes the connection
+     */
     HttpServer(int port, std::string address, EndpointHandler h);
-    ///Destroys server, stops the thread
+    ///Destroys server, closes all connections
     ~HttpServer();
 
-    void serve(int conn, std::string &buffer) noexcept;
-
-
-
-
     ///Server status/error page
     /**
-     * @param buffer temporary buffer (should be preallocated)
-     * @param conn connected socket
+     * @param conn connection
      * @param status_line status line, must be in correct form, "<code> <message>
      *    for example "404 Not found". Otherwise invalid response can be produced
      * @param extra_msg extra message put to error page. Note that content type
      * of the body is text/plain, so no http formatting is allowed
      *
-     * @note you need to close connection manually
+     * @note response is queued, the connection is closed after it is sent
+     */
+    static void send_status(Connection &conn, std::string_view status_line, std::string_view extra_msg = std::string_view())  noexcept;
+
+    ///Format time as HTTP date (for example Last-Modified)
+    static std::string http_date(std::time_t t);
+
+    ///Run the server
+    /**
+     * Connections are multiplexed by epoll and processed by a pool of worker threads. Function
+     * returns when stop is requested
      *
-     * @note MT Safety - function is MT Safe
+     * @param stop_token stop token
+     * @param threads count of worker threads, including the calling thread
      */
-    static void send_status(std::string &buffer, int conn, std::string_view status_line, std::string_view extra_msg = std::string_view())  noexcept;
+    void run(std::stop_token stop_token, unsigned int threads = 1);
 
-    ///block execution until a connection is accepted, then process serve the content and return
+    ///Configure persistent connections
     /**
-     * @retval true processed successful
-     * @retval false server has been stopped
+     * @param idle_timeout idle connection is closed after this timeout
+     * @param max_requests maximum count of requests processed by single connection. Set 1 to
+     * disable persistent connections
+     *
+     * @note must be called before run()
      */
-    bool accept_and_serve() noexcept;
+    void set_keep_alive(std::chrono::seconds idle_timeout, unsigned int max_requests);
 
+    ///Set metrics registry
+    /**
+     * The server updates metrics of requests and connections. The registry can be shared
+     * with other components, which can record their metrics (for example rebuilds)
+     *
+     * @param metrics metrics registry
+     * @note must be called before run()
+     */
+    void set_metrics(std::shared_ptr<ServerMetrics> metrics) {_metrics = std::move(metrics);}
+
+    ///Retrieve metrics registry
+    ServerMetrics &metrics() {return *_metrics;}
 
-    void run(std::stop_token stop_token);
+    ///Expose all metrics at the path (OpenMetrics format)
+    /**
+     * The endpoint is disabled by default. When enabled, the path is answered by the server
+     * before the request is passed to the handler
+     *
+     * @param path path of the endpoint, empty string disables the endpoint
+     * @note must be called before run()
+     */
+    void enable_metrics_endpoint(std::string path = "/metrics") {_metrics_path = std::move(path);}
 
 
 protected:
     EndpointHandler _h;
 
     ///mother socket
-    int _mother = 0;
+    int _mother = -1;
+    ///epoll
+    int _epoll = -1;
+    ///eventfd to stop workers
+    int _wakeup = -1;
+    ///timerfd to close idle connections
+    int _timer = -1;
+
+    std::chrono::seconds _idle_timeout = std::chrono::seconds(15);
+    unsigned int _max_requests = 1000;
+    std::shared_ptr<ServerMetrics> _metrics = std::make_shared<ServerMetrics>();
+    ///path of the metrics endpoint, empty if disabled
+    std::string _metrics_path;
+
+    std::mutex _lock;
+    std::unordered_map<Connection *, std::unique_ptr<Connection> > _connections;
+
+    void worker() noexcept;
+    void accept_connections() noexcept;
+    void close_idle() noexcept;
+    void process(Connection &conn, std::uint32_t events) noexcept;
+    void serve(Connection &conn, std::size_t header_end) noexcept;
+    void rearm(Connection &conn, std::uint32_t events) noexcept;
+    void close(Connection &conn) noexcept;
 
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,37 @@
+#include "singleflight.h"
+
+bool SingleFlight::run(const std::function<void()> &task) {
+    std::unique_lock lk(_lock);
+    std::shared_ptr<Flight> flight;
+    if (_current || _next) {
+        //the running task may have missed the trigger of this call, so the caller
+        //joins the next run, which starts after the running task finishes
+        if (!_next) _next = std::make_shared<Flight>();
+        flight = _next;
+        _done.wait(lk, [&]{return flight->done || (!_current && _next == flight);});
+        if (flight->done) {
+            if (flight->error) std::rethrow_exception(flight->error);
+            return false;
+        }
+        //first caller woken up starts the next run
+        _next = nullptr;
+    } else {
+        flight = std::make_shared<Flight>();
+    }
+    _current = flight;
+    lk.unlock();
+    std::exception_ptr error;
+    try {
+        task();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    lk.lock();
+    flight->error = error;
+    flight->done = true;
+    _current = nullptr;
+    _done.notify_all();
+    lk.unlock();
+    if (error) std::rethrow_exception(error);
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef _builder_src_singleflight_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_singleflight_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+///Collapses concurrent runs of a task into single run
+/**
+ * When the task is already running, the caller doesn't start it again. The running task
+ * may have already read the state changed before the call, so the caller schedules single
+ * trailing run, which starts after the running task finishes, and shares its result with
+ * all callers arrived meanwhile. So a burst of triggers (for example concurrent reloads
+ * of pages) causes at most two runs instead of a queue of runs
+ */
+class SingleFlight {
+public:
+
+    ///Run the task or join the trailing run
+    /**
+     * @param task task to run. Callers sharing the run must pass equivalent tasks, the
+     * task of any of them can be used
+     * @retval true the task has been run by this call
+     * @retval false the call joined the run started by other caller
+     * @exception any exception thrown by the task is rethrown to all callers
+     * sharing the run
+     */
+    bool run(const std::function<void()> &task);
+
+protected:
+
+    struct Flight {
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    std::mutex _lock;
+    std::condition_variable _done;
+    ///running task, nullptr if none
+    std::shared_ptr<Flight> _current;
+    ///run scheduled after the running task, nullptr if none
+    std::shared_ptr<Flight> _next;
+};
+
+
+#endif
@@ -0,0 +1,136 @@
+#include "static_handler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+StaticFileHandler::StaticFileHandler(std::filesystem::path root, std::string index)
+    :_state(std::make_shared<State>()) {
+    _state->root = std::move(root);
+    _state->index = std::move(index);
+}
+
+std::shared_ptr<const StaticFileHandler::Resolved> StaticFileHandler::lookup(std::string_view subpath) const {
+    subpath = subpath.substr(0, subpath.find('?'));
+    {
+        std::shared_lock _(_state->lock);
+        auto iter = _state->resolved.find(subpath);
+        if (iter != _state->resolved.end()) return iter->second;
+    }
+    auto r = std::make_shared<Resolved>();
+    r->file = _state->root;
+    bool empty = true;
+    std::string_view path = subpath;
+    while (!path.empty()) {
+        auto q = path.find('/');
+        std::string_view part = path.substr(0, q);
+        path = q == path.npos?std::string_view():path.substr(q+1);
+        if (!part.empty() && part != "." && part != "..") {
+            r->file /= part;
+            empty = false;
+            //hidden files (state of the build, temporary files) are never served
+            if (part.front() == '.') r->hidden = true;
+        }
+    }
+    if (empty) r->file /= _state->index;
+    r->content_type = content_type_of(r->file.filename().native());
+
+    std::unique_lock _(_state->lock);
+    if (_state->resolved.size() >= max_resolved) _state->resolved.clear();
+    _state->resolved.emplace(std::string(subpath), r);
+    return r;
+}
+
+static int open_regular(const std::filesystem::path &p, struct stat &st) {
+    int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd >= 0 && (::fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+void StaticFileHandler::operator()(HttpServer::Request &req) const {
+    const auto &state = *_state;
+    auto r = lookup(req.subpath);
+    const auto &file_path = r->file;
+    auto log = [&](std::string_view result) {
+        if (state.log) state.log(req, file_path, result);
+    };
+
+    struct stat st;
+    int fd = r->hidden?-1:open_regular(file_path, st);
+    if (fd < 0) {
+        log("NOT FOUND!");
+        req.send(404,"Not found","text/plain","Not found");
+        return;
+    }
+
+    std::string_view content_type = r->content_type;
+    if (state.immutable && state.immutable(file_path.filename().native())) {
+        req.add_header("Cache-Control", "public, max-age=31536000, immutable");
+    }
+    req.add_header("Accept-Ranges", "bytes");
+    //small files are not worth to compress
+    bool gzip = false;
+    if (is_compressible(content_type) && st.st_size > 256) {
+        req.add_header("Vary", "Accept-Encoding");
+        gzip = req.accepts_encoding("gzip");
+    }
+    char etag[64];
+    std::snprintf(etag, sizeof(etag), "%llx-%llx-%llx",
+            static_cast<unsigned long long>(st.st_ino),
+            static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec,
+            static_cast<unsigned long long>(st.st_size));
+    //ranges are served from the uncompressed content
+    std::vector<HttpServer::ByteRange> ranges;
+    auto rs = req.ranges(st.st_size, etag, st.st_mtime, ranges);
+    if (rs != HttpServer::RangeStatus::whole) gzip = false;
+    if (gzip) std::strcat(etag, "-gz");
+    if (req.not_modified(etag, st.st_mtime)) {
+        ::close(fd);
+        log("not modified");
+        return;
+    }
+    if (rs == HttpServer::RangeStatus::unsatisfiable) {
+        ::close(fd);
+        log("range not satisfiable");
+        req.send_unsatisfiable(st.st_size);
+        return;
+    }
+    if (rs == HttpServer::RangeStatus::partial) {
+        log(content_type);
+        req.send_ranges(content_type, fd, ranges);
+        return;
+    }
+
+    log(content_type);
+
+    if (gzip) {
+        req.add_header("Content-Encoding", "gzip");
+        //use precompressed file, if it is not older than the original
+        auto gz_path = file_path;
+        gz_path += ".gz";
+        struct stat gz_st;
+        int gz_fd = open_regular(gz_path, gz_st);
+        if (gz_fd >= 0) {
+            if (std::tie(gz_st.st_mtim.tv_sec, gz_st.st_mtim.tv_nsec) >= std::tie(st.st_mtim.tv_sec, st.st_mtim.tv_nsec)) {
+                ::close(fd);
+                req.send(200,"OK",content_type, gz_fd);
+                return;
+            }
+            ::close(gz_fd);
+        }
+        auto data = _state->gz_cache.get(file_path, fd);
+        ::close(fd);
+        if (!data) throw std::runtime_error("Failed to read file");
+        req.send(200,"OK",content_type, std::move(data));
+        return;
+    }
+
+    req.send(200,"OK",content_type, fd);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#ifndef _builder_src_static_handler_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_static_handler_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include "server.h"
+#include "compress.h"
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+///Serves files from a directory
+/**
+ * Maps Request::subpath to a file under the root directory (segments "." and ".." are
+ * ignored, so the request can't escape the root). Hidden files and directories (names
+ * beginning with '.', for example the state of the build) are answered by 404. Resolved paths and their content types
+ * are cached, so repeated requests don't parse the path again. The file is sent
+ * by sendfile(), conditional requests are answered by 304. Text content is compressed for
+ * clients accepting gzip, precompressed .gz file is used when it is not older
+ * than the original, otherwise the content is compressed on the fly and cached.
+ * Range requests (including If-Range and multiple ranges) are served from the
+ * uncompressed file
+ *
+ * The object can be copied, copies share the cache. It can be passed directly to the
+ * HttpServer or mounted by the HttpRouter
+ */
+class StaticFileHandler {
+public:
+
+    ///Determines whether the file never changes (for example, its name contains hash of the content)
+    using ImmutableTest = std::function<bool(std::string_view name)>;
+    ///Receives request, resolved file and result (content type, "not modified", "range not satisfiable", "NOT FOUND!")
+    using Log = std::function<void(const HttpServer::Request &req, const std::filesystem::path &file, std::string_view result)>;
+
+    ///Construct handler
+    /**
+     * @param root root directory
+     * @param index file served for the root path (/)
+     */
+    explicit StaticFileHandler(std::filesystem::path root, std::string index = "index.html");
+
+    ///Set test of immutable files, they are sent with Cache-Control: immutable
+    void set_immutable(ImmutableTest test) {_state->immutable = std::move(test);}
+    ///Set log function
+    void set_log(Log log) {_state->log = std::move(log);}
+
+    ///Resolve path to the file
+    /**
+     * @param subpath path relative to the root (query is ignored)
+     * @return path to the file. It doesn't need to exist
+     */
+    std::filesystem::path resolve(std::string_view subpath) const {return lookup(subpath)->file;}
+
+    ///Handle request
+    void operator()(HttpServer::Request &req) const;
+
+protected:
+
+    struct Resolved {
+        std::filesystem::path file;
+        std::string_view content_type;
+        ///path contains a hidden file or directory
+        bool hidden = false;
+    };
+
+    ///allows lookup by string_view
+    struct PathHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view s) const {return std::hash<std::string_view>()(s);}
+    };
+
+    struct State {
+        std::filesystem::path root;
+        std::string index;
+        ImmutableTest immutable;
+        Log log;
+        std::shared_mutex lock;
+        std::unordered_map<std::string, std::shared_ptr<const Resolved>, PathHash, std::equal_to<> > resolved;
+        GzipCache gz_cache;
+    };
+
+    ///maximum count of cached paths, the cache is cleared when it is full
+    static constexpr std::size_t max_resolved = 4096;
+
+    std::shared_ptr<State> _state;
+
+    std::shared_ptr<const Resolved> lookup(std::string_view subpath) const;
+};
+
+
+#endif
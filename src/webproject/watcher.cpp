@@ -0,0 +1,134 @@
+#include "watcher.h"
+
+#include <array>
+#include <cstdint>
+#include <system_error>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+static constexpr std::uint32_t watch_mask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB
+        | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF;
+static constexpr std::uint32_t structure_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW;
+
+FileWatcher::FileWatcher() {
+    _fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (_fd < 0) {
+        throw std::system_error(errno, std::system_category(), "FileWatcher: inotify_init failed");
+    }
+    _wakeup = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (_wakeup < 0) {
+        int e = errno;
+        ::close(_fd);
+        throw std::system_error(e, std::system_category(), "FileWatcher: eventfd failed");
+    }
+}
+
+FileWatcher::~FileWatcher() {
+    ::close(_wakeup);
+    ::close(_fd);
+}
+
+void FileWatcher::watch(const std::vector<std::filesystem::path> &files, const std::vector<std::filesystem::path> &dirs) {
+    std::unordered_set<std::filesystem::path> need;
+    std::error_code ec;
+    _files.clear();
+    for (const auto &f: files) {
+        auto p = std::filesystem::weakly_canonical(f, ec);
+        if (ec) continue;
+        _files.insert(p.string());
+        need.insert(p.parent_path());
+    }
+    for (const auto &d: dirs) {
+        auto p = std::filesystem::weakly_canonical(d, ec);
+        if (ec) continue;
+        need.insert(p);
+    }
+
+    for (auto iter = _dirs.begin(); iter != _dirs.end();) {
+        if (need.find(iter->first) == need.end()) {
+            inotify_rm_watch(_fd, iter->second);
+            _watches.erase(iter->second);
+            iter = _dirs.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    for (const auto &d: need) {
+        if (_dirs.find(d) != _dirs.end()) continue;
+        int wd = inotify_add_watch(_fd, d.c_str(), watch_mask|IN_ONLYDIR);
+        if (wd < 0) continue;   //directory doesn't exist, it can't be watched
+        _dirs.emplace(d, wd);
+        _watches[wd] = d;
+    }
+}
+
+bool FileWatcher::read_events() {
+    alignas(inotify_event) std::array<char, 16384> buffer;
+    bool changed = false;
+    for(;;) {
+        auto r = ::read(_fd, buffer.data(), buffer.size());
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return changed;
+        }
+        if (r == 0) return changed;
+        const char *ptr = buffer.data();
+        const char *end = ptr + r;
+        while (ptr < end) {
+            const auto *ev = reinterpret_cast<const inotify_event *>(ptr);
+            ptr += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_IGNORED) {
+                //watch has been removed (directory deleted), allow to add it again
+                auto iter = _watches.find(ev->wd);
+                if (iter != _watches.end()) {
+                    _dirs.erase(iter->second);
+                    _watches.erase(iter);
+                }
+                changed = true;
+                continue;
+            }
+            if (ev->mask & structure_mask) {
+                changed = true;
+                continue;
+            }
+            auto iter = _watches.find(ev->wd);
+            if (iter != _watches.end() && ev->len) {
+                auto fname = (iter->second / ev->name).string();
+                if (_files.find(fname) != _files.end()) changed = true;
+            }
+        }
+    }
+}
+
+bool FileWatcher::wait_events(int timeout_ms) {
+    std::array<pollfd, 2> fds = {{
+        {_fd, POLLIN, 0},
+        {_wakeup, POLLIN, 0}
+    }};
+    int r = ::poll(fds.data(), fds.size(), timeout_ms);
+    if (r < 0 && errno != EINTR) {
+        throw std::system_error(errno, std::system_category(), "FileWatcher: poll failed");
+    }
+    return !(fds[1].revents & POLLIN);
+}
+
+bool FileWatcher::wait(std::stop_token stop_token, std::chrono::milliseconds debounce) {
+    std::stop_callback cb(stop_token, [&]{
+        std::uint64_t v = 1;
+        [[maybe_unused]] auto r = ::write(_wakeup, &v, sizeof(v));
+    });
+    bool changed = false;
+    while (!changed) {
+        if (stop_token.stop_requested() || !wait_events(-1)) return false;
+        changed = read_events();
+    }
+    //debounce - wait until changes stop
+    do {
+        if (stop_token.stop_requested() || !wait_events(static_cast<int>(debounce.count()))) return false;
+    } while (read_events());
+    return true;
+}
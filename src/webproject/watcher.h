@@ -0,0 +1,57 @@
+#pragma once
+#ifndef _builder_src_watcher_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+#define _builder_src_watcher_H_33l5L4toO32gojld5kS62qb6aCNCOcn2_
+
+#include <chrono>
+#include <filesystem>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+///Watches files and directories for changes (uses inotify)
+class FileWatcher {
+public:
+
+    FileWatcher();
+    ~FileWatcher();
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    ///Set files and directories to watch
+    /**
+     * Directories of the files are watched, so replacing the file (for example by the editor) is detected too.
+     * Any file created, deleted or moved in watched directories is also reported as change. Events
+     * which were not yet processed are kept, so changes made before this call are not lost
+     *
+     * @param files list of files
+     * @param dirs list of directories
+     */
+    void watch(const std::vector<std::filesystem::path> &files, const std::vector<std::filesystem::path> &dirs);
+
+    ///Wait for a change
+    /**
+     * @param stop_token stop token, stops waiting
+     * @param debounce after change is detected, function waits until no other change is
+     * reported for this time. This collapses bursts of changes into single notification
+     * @retval true change detected
+     * @retval false stop requested
+     */
+    bool wait(std::stop_token stop_token, std::chrono::milliseconds debounce);
+
+protected:
+    int _fd = -1;
+    int _wakeup = -1;
+    std::unordered_map<int, std::filesystem::path> _watches;
+    std::unordered_map<std::filesystem::path, int> _dirs;
+    std::unordered_set<std::string> _files;
+
+    ///read pending events, returns true if relevant change was detected
+    bool read_events();
+    ///wait for events, returns false if stop requested
+    bool wait_events(int timeout_ms);
+};
+
+
+#endif
@@ -1,23 +1,34 @@
 #include "webproject.h"
 #include "builder.h"
+#include "project.h"
 #include "server.h"
+#include "router.h"
+#include "static_handler.h"
+#include "response_cache.h"
+#include "watcher.h"
+#include "singleflight.h"
+#include "profiler.h"
 #include <webproject_version.h>
 
 #include <iostream>
 #include <cstdlib>
-#include <fstream>
 #include <chrono>
+#include <thread>
+#include <algorithm>
 
 enum class SetMode {
     input,
     path,
     output,
     mode,
-    server
+    server,
+    threads,
+    depfile,
+    trace
 };
 
 void show_help() {
-    std::cout << "Usage: webproject <switches> source_file.js\n\n"
+    std::cout << "Usage: webproject <switches> source_file.js [source_file2.js ...]\n\n"
         "-h (--help)               Show help\n"
         "-v                        Print version\n"
         "-I <path>                 Add search path for scripts\n"
@@ -25,26 +36,51 @@ void show_help() {
         "-H <path>                 Add search path for header fragments\n"
         "-T <path>                 Add search path for page templates\n"
         "-F <path>                 Add search path for page fragments\n"
-        "-o <path/index.html>      Set output html page\n"
-        "-s <addr:port>            Start server at addr:port (for example localhost:10000)"
+        "-o <path/index.html>      Set output html page (repeat for each source file, in the same order)\n"
+        "-R <path>                 Add search path for resources\n"
+        "-s <addr:port>            Start server at addr:port (for example localhost:10000)\n"
+        "-t <threads>              Count of server threads (default: count of CPUs)\n"
+        "-M                        Minify inlined scripts (onepage mode)\n"
+        "-z                        Create gzip compressed copies (.gz) of the page, scripts and styles\n"
+        "-f                        Put content hash to names of linked files (long-term caching)\n"
+        "-S                        Move scripts and styles shared by multiple pages to common chunks\n"
+        "-MD                       Write dependency file (Makefile format) to <output page>.d\n"
+        "                           (one file for each output page)\n"
+        "-MF <file>                Write dependency file to specified file\n"
+        "                           (single file, all output pages depend on all sources)\n"
+        "--stats                   Print statistics of the build (time of phases, I/O, filters)\n"
+        "--trace <file>            Write trace of the build (Chrome trace-event format)\n"
+        "-w                        Watch mode - rebuild page in background whenever a source file changes\n"
         "-m <build mode>           Select build mode\n"
         "           s,symlink        -link all linkable resources by symlinks\n"
         "           h,hardlink       -link all linkable resources by hardlinks\n"
         "           c,copy           -copy all linkable resources\n"
-        "           p,onepage        -create one page with inline styles and scripts\n";
+        "           p,onepage        -create one page with inline styles and scripts\n"
+        "           e,embed          -generate C++ sources (index.h, index.cpp for index.html)\n"
+        "                             which contain the page and all linked files\n";
 }
 
 int main(int argc, char **argv) {    
 
-    PageBuilder bld([](std::string file, int line, std::string msg){
+    ProjectBuilder bld([](std::string file, int line, std::string msg){
         std::cerr << file << ":" << line << " warning: " << msg << std::endl;
     });
 
 
-    std::string out_path;
-    std::string in_path;
+    std::vector<std::string> out_paths;
+    std::vector<std::string> in_paths;
     std::string server_addr;
     BuildMode build_mode = BuildMode::onefile;
+    bool watch_mode = false;
+    bool fingerprint = false;
+    bool minify = false;
+    bool compress = false;
+    bool shared_chunks = false;
+    bool depfile = false;
+    std::string depfile_path;
+    bool print_stats = false;
+    std::string trace_path;
+    unsigned int server_threads = std::max(1U, std::thread::hardware_concurrency());
     SetMode set_mode = SetMode::input;
     SearchPaths::List SearchPaths::*cur_path= nullptr;
     SearchPaths srch;
@@ -57,6 +93,7 @@ int main(int argc, char **argv) {
                 return 1;
             }
             char c = argv[arg][1];
+            int value_pos = 2;
             switch (c) {
                 case 'I': cur_path = &SearchPaths::scripts;set_mode = SetMode::path;break;
                 case 'R': cur_path = &SearchPaths::resources;set_mode = SetMode::path;break;
@@ -65,14 +102,30 @@ int main(int argc, char **argv) {
                 case 'T': cur_path = &SearchPaths::page_templates;set_mode = SetMode::path;break;
                 case 'F': cur_path = &SearchPaths::page_fragments;set_mode = SetMode::path;break;
                 case 's': set_mode = SetMode::server;break;
+                case 't': set_mode = SetMode::threads;break;
                 case 'o': set_mode = SetMode::output;break;
                 case 'm': set_mode = SetMode::mode;break;
+                case 'w': watch_mode = true;++arg;continue;
+                case 'z': compress = true;++arg;continue;
+                case 'f': fingerprint = true;++arg;continue;
+                case 'M': if (argv[arg][2] == 0) {minify = true;++arg;continue;}
+                          if (argv[arg][2] == 'D' && argv[arg][3] == 0) {depfile = true;++arg;continue;}
+                          if (argv[arg][2] == 'F') {depfile = true;set_mode = SetMode::depfile;value_pos = 3;break;}
+                          std::cerr << "unknown switch " <<  argv[arg] << std::endl; return 1;
+                case 'S': shared_chunks = true;++arg;continue;
                 case 'v': std::cout << PROJECT_WEBPROJECT_VERSION << std::endl;
                           return 0;
                 case 'h': show_help();return 0;break;
+                case '-': {
+                    std::string_view lng(argv[arg]+2);
+                    if (lng == "help") {show_help();return 0;}
+                    if (lng == "stats") {print_stats = true;++arg;continue;}
+                    if (lng == "trace") {set_mode = SetMode::trace;++arg;continue;}
+                    std::cerr << "unknown switch " <<  argv[arg] << std::endl; return 1;
+                }
                 default: std::cerr << "unknown switch -" <<  c << std::endl; return 1;
             }
-            a = argv[arg]+2;
+            a = argv[arg]+value_pos;
             if (a.empty()) {
                 ++arg;
                 continue;
@@ -90,17 +143,14 @@ int main(int argc, char **argv) {
                 else if (a == "h" || a == "hardlink") build_mode = BuildMode::hardlink;
                 else if (a == "c" || a == "copy") build_mode = BuildMode::copy;
                 else if (a == "o" || a == "p" || a == "onefile") build_mode = BuildMode::onefile;
+                else if (a == "e" || a == "embed") build_mode = BuildMode::embed;
                 else {
-                    std::cerr << "Invalid buildmode:  " << a << " is not in (symlink, hardlink, copy, onefile)" << std::endl;
+                    std::cerr << "Invalid buildmode:  " << a << " is not in (symlink, hardlink, copy, onefile, embed)" << std::endl;
                     return 1;
                 }
                 break;
             case SetMode::input:
-                if (in_path.empty()) in_path = a;
-                else {
-                    std::cerr << "Input file is already set:" << in_path << std::endl;
-                    return 1;
-                }
+                in_paths.push_back(std::string(a));
                 break;
             default:
             case SetMode::server:
@@ -110,33 +160,169 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 break;
-            case SetMode::output:    
-                if (out_path.empty()) out_path = a;
-                else {
-                    std::cerr << "Output path is already set:" << out_path << std::endl;
+            case SetMode::threads:
+                server_threads = std::atoi(std::string(a).c_str());
+                if (server_threads == 0) {
+                    std::cerr << "Invalid count of threads: " << a << std::endl;
                     return 1;
                 }
+                break;
+            case SetMode::output:    
+                out_paths.push_back(std::string(a));
                 break;            
+            case SetMode::depfile:
+                depfile_path = a;
+                break;
+            case SetMode::trace:
+                trace_path = a;
+                break;
         }
         set_mode = SetMode::input;
         ++arg;
     }
 
-    if (in_path.empty()) {
+    if (in_paths.empty()) {
         std::cerr << "Missing arguments, use -h for help" << std::endl;
         return 2;
     }
 
-    if (out_path.empty()) {
+    if (out_paths.empty()) {
         std::cerr << "Target directory is not specified (use -o <target>)" << std::endl;return 4;
     }
-    auto input_path = std::filesystem::weakly_canonical(in_path);
-    auto output_path = std::filesystem::weakly_canonical(out_path);
+    if (out_paths.size() != in_paths.size()) {
+        std::cerr << "Every input file needs its own output page (use -o <target> for each input)" << std::endl;return 4;
+    }
+    if (build_mode == BuildMode::embed && !server_addr.empty()) {
+        std::cerr << "Server can't serve embedded files, use other build mode" << std::endl;return 4;
+    }
+    for (std::size_t i = 0; i < in_paths.size(); ++i) {
+        //target directory may not exist yet, so make the path absolute first
+        bld.add_page(std::filesystem::weakly_canonical(in_paths[i]), std::filesystem::weakly_canonical(std::filesystem::absolute(out_paths[i])));
+    }
+    auto output_path = bld.get_target(0);
+    bld.set_compress(compress);
+    bld.set_fingerprint(fingerprint);
+    bld.set_shared_chunks(shared_chunks);
+    if (minify) {
+        bld.set_minify(true, [](const std::filesystem::path &file, std::size_t before, std::size_t after){
+            std::cout << "Minified " << file.string() << ": " << before << " -> " << after << " bytes" << std::endl;
+        });
+    }
 
     try {
 
-        bld.prepare(input_path, srch);
-        bld.build(output_path,build_mode);
+        //in server mode, the pages are built in memory and served from there
+        bool write_page = server_addr.empty();
+        auto base_dir = output_path.parent_path();
+        //published files with prepared responses, updated after every build
+        ResponseCache published;
+        published.set_log([](const HttpServer::Request &req, const std::filesystem::path &file, std::string_view result) {
+            std::cout << "GET " << req.path << " -> " << file.string() << " " << result << std::endl;
+        });
+        auto url_of = [&](const std::filesystem::path &file) {
+            auto rel = file.lexically_relative(base_dir);
+            std::string url;
+            //files outside of the root directory are not accessible
+            if (rel.empty() || *rel.begin() == "..") return url;
+            url.append("/").append(rel.generic_string());
+            return url;
+        };
+        auto publish_page = [&]{
+            if (write_page) return;
+            std::vector<ResponseCache::Asset> assets;
+            for (const auto &a: bld.get_assets()) {
+                auto url = url_of(a.file);
+                if (url.empty()) continue;
+                ResponseCache::Asset asset;
+                asset.path = std::move(url);
+                asset.file = a.file;
+                asset.compressed = a.compressed;
+                if (a.data) {
+                    asset.data = a.data;
+                    asset.etag = PageBuilder::content_hash(*a.data);
+                }
+                if (fingerprint && PageBuilder::is_fingerprinted(a.file.filename().native())) {
+                    asset.cache_control = "public, max-age=31536000, immutable";
+                }
+                assets.push_back(std::move(asset));
+            }
+            for (std::size_t i = 0; i < bld.size(); ++i) {
+                const auto &b = bld.get_builder(i);
+                auto url = url_of(bld.get_target(i));
+                if (!b.get_page()) continue;
+                auto version = b.get_page_version();
+                ResponseCache::Asset asset;
+                asset.path = std::move(url);
+                asset.file = bld.get_target(i);
+                asset.data = b.get_page();
+                asset.etag = version.etag;
+                asset.last_modified = version.last_modified;
+                //the page refers fingerprinted files, so it must be always revalidated
+                if (fingerprint) asset.cache_control = "no-cache";
+                if (i == 0) {
+                    auto root = asset;
+                    root.path.assign(1, '/');
+                    assets.push_back(std::move(root));
+                }
+                if (!asset.path.empty()) assets.push_back(std::move(asset));
+            }
+            //the previous build is served until this point, then all files are replaced at once
+            published.update(assets);
+        };
+        //outputs produced after every build (depfile, statistics, trace)
+        auto finish_build = [&]{
+            if (depfile && !depfile_path.empty()) {
+                bld.write_depfile(depfile_path);
+            } else if (depfile) {
+                for (std::size_t i = 0; i < bld.size(); ++i) bld.write_depfile(i, bld.get_target(i).string()+".d");
+            }
+            if (print_stats) BuildProfiler::print_stats(std::cout);
+            if (!trace_path.empty() && !BuildProfiler::write_trace(trace_path)) {
+                std::cerr << "Failed to write trace: " << trace_path << std::endl;
+            }
+        };
+
+        //metrics of the server, rebuilds are recorded even before the server is started
+        auto metrics = std::make_shared<ServerMetrics>();
+
+        if (print_stats || !trace_path.empty()) BuildProfiler::enable(!trace_path.empty());
+        bld.load_state();
+        bld.prepare(srch);
+        bld.build(build_mode, write_page);
+        publish_page();
+        finish_build();
+
+        std::jthread watch_thread;
+        if (watch_mode) {
+            auto watch_loop = [&](std::stop_token stop_token) {
+                FileWatcher watcher;
+                do {
+                    watcher.watch(bld.get_inputs(), bld.get_search_dirs());
+                    if (!watcher.wait(stop_token, std::chrono::milliseconds(100))) break;
+                    try {
+                        auto start = std::chrono::steady_clock::now();
+                        BuildProfiler::reset();
+                        bld.prepare(srch);
+                        bld.build(build_mode, write_page);
+                        publish_page();
+                        metrics->rebuild(std::chrono::steady_clock::now() - start);
+                        finish_build();
+                        auto dur = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+                        std::cout << "Rebuilt " << output_path.string();
+                        if (bld.size() > 1) std::cout << " and " << bld.size() - 1 << " other page(s)";
+                        std::cout << " in " << dur.count() << " ms" << std::endl;
+                    } catch (const std::exception &e) {
+                        std::cerr << "Build failed: " << e.what() << std::endl;
+                    }
+                } while (true);
+            };
+            if (server_addr.empty()) {
+                std::cout << "Watching for changes. Press Ctrl-C to stop" << std::endl;
+                watch_loop({});
+                return 0;
+            }
+            watch_thread = std::jthread(watch_loop);
+        }
 
         if (!server_addr.empty()) {
             auto sep = server_addr.rfind(':');
@@ -147,60 +333,49 @@ int main(int argc, char **argv) {
             if (port == 0) {
                 std::cerr << "Invalid port address. Failed to start server" << std::endl;return 6;
             }
-            auto base_dir = output_path.parent_path();
-            HttpServer server(port,server_addr.substr(0,sep), [&](HttpServer::Request &req) {
-                auto path = req.path;                
-                auto q = path.find('?');
-                if (q != path.npos) path = path.substr(0,q);
-                q = path.find('/');
-                auto file_path = base_dir;
-                while (q != path.npos) {
-                    std::string_view part = path.substr(0,q);
-                    path = path.substr(q+1);
-                    if (!part.empty() && part != "." && part != "..") {
-                        file_path = file_path/part;
-                    }
-                    q = path.find('/');
-                }
-                if (!path.empty() && path != "." && path != "..") {
-                    file_path = file_path/path;
-                }
-                if (file_path == base_dir) {
-                    file_path = output_path;
-                }
-                if (file_path == output_path) {
-                    bld.prepare(input_path,srch);
-                    bld.build(out_path,build_mode);                    
-                } 
-                std::ifstream in((std::string(file_path)));
-                if (!in) {
-                    std::cout << "GET " << req.path << " -> " << file_path.string() << " NOT FOUND!" << std::endl;
-                    req.send(404,"Not found","text/plain","Not found");
-                    return;
-                }
-
-                std::string ext = file_path.extension();
-
-                std::string_view content_type;
-                if (ext == ".html" || ext == ".htm") content_type = "text/html;charset=utf-8";
-                else if (ext == ".css")  content_type = "text/css;charset=utf-8";
-                else if (ext == ".js")  content_type = "text/javascript;charset=utf-8";
-                else if (ext == ".png")  content_type = "image/png";
-                else if (ext == ".jpg")  content_type = "image/jpeg";
-                else if (ext == ".jpeg")  content_type = "image/jpeg";
-                else if (ext == ".gif")  content_type = "image/gif";
-                else if (ext == ".svg")  content_type = "image/svg+xml";
-                else content_type = "application/octet-stream";
-
-                std::cout << "GET " << req.path << " -> " << file_path.string() << " " << content_type << std::endl;
+            StaticFileHandler files(base_dir);
+            if (fingerprint) files.set_immutable(&PageBuilder::is_fingerprinted);
+            files.set_log([](const HttpServer::Request &req, const std::filesystem::path &file, std::string_view result) {
+                std::cout << "GET " << req.path << " -> " << file.string() << " " << result << std::endl;
+            });
+            auto serve_file = [&](HttpServer::Request &req) {
+                if (!published.serve(req)) files(req);
+            };
+            //concurrent reloads share single build
+            SingleFlight rebuild;
+            auto serve_page = [&](HttpServer::Request &req) {
+                rebuild.run([&]{
+                    auto start = std::chrono::steady_clock::now();
+                    BuildProfiler::reset();
+                    bld.prepare(srch);
+                    bld.build(build_mode,write_page);
+                    publish_page();
+                    metrics->rebuild(std::chrono::steady_clock::now() - start);
+                    finish_build();
+                });
+                //exact route has subpath "/", but the pages are published under their paths
+                req.subpath = req.path;
+                serve_file(req);
+            };
 
+            HttpRouter router;
+            //in watch mode, the pages are not rebuilt on request
+            if (!watch_mode) {
+                router.add_exact("/", serve_page);
+                for (std::size_t i = 0; i < bld.size(); ++i) {
+                    auto url = url_of(bld.get_target(i));
+                    if (!url.empty()) router.add_exact(url, serve_page);
+                }
+            }
+            router.add_prefix("/", serve_file);
 
-                req.send(200,"OK",content_type, in);
-            });
+            HttpServer server(port,server_addr.substr(0,sep), router);
+            server.set_metrics(metrics);
+            server.enable_metrics_endpoint();
             std::cout << "Server started at http://" << server_addr << "/ -> " << output_path.string() << ". Press Ctrl-C to stop" <<  std::endl;
             do {
                 //exit by ctrl+c;
-                server.run({});
+                server.run({}, server_threads);
             } while (true);
         }
 